@@ -0,0 +1,48 @@
+#include "mtr/metrics.hpp"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+
+/*
+ * Measures the cost of reading each of the clock policies that
+ * METRICS_RECORD_BLOCK_WITH accepts.
+ */
+
+namespace {
+
+constexpr int reads = 5000000;
+
+template <typename Clock>
+double nanoseconds_per_read() {
+    std::uint64_t sink = 0;
+
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < reads; ++i) {
+        sink += Clock::now();
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    /* Keep the reads from being optimised away. */
+    volatile std::uint64_t result = sink;
+    (void) result;
+
+    const auto nanoseconds =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    return static_cast<double>(nanoseconds) / reads;
+}
+
+} // namespace
+
+int main() {
+    std::printf("%-24s %8.2f ns\n", "steady_clock", nanoseconds_per_read<mtr::steady_clock>());
+    std::printf("%-24s %8.2f ns\n", "high_resolution_clock",
+                nanoseconds_per_read<mtr::high_resolution_clock>());
+    std::printf("%-24s %8.2f ns\n", "coarse_clock", nanoseconds_per_read<mtr::coarse_clock>());
+    std::printf("%-24s %8.2f ns\n", "thread_cpu_clock",
+                nanoseconds_per_read<mtr::thread_cpu_clock>());
+    std::printf("%-24s %8.2f ns (invariant: %d)\n", "tsc_clock",
+                nanoseconds_per_read<mtr::tsc_clock>(), mtr::tsc_clock::is_invariant());
+
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include "mtr/metrics.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+ * Compares updating one shared metric from many threads through an
+ * atomic_block_recording against a block_recording guarded by a mutex.
+ */
+
+namespace {
+
+constexpr int updates_per_thread = 200000;
+
+class mutex_block_recording {
+public:
+    void update(std::chrono::nanoseconds elapsed) {
+        std::lock_guard<std::mutex> guard(mutex_);
+        recording_.update(elapsed);
+    }
+
+private:
+    std::mutex mutex_;
+    mtr::block_recording recording_;
+};
+
+template <typename Recording>
+double nanoseconds_per_update(int thread_count) {
+    Recording recording;
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&recording, t]() {
+            for (int i = 0; i < updates_per_thread; ++i) {
+                recording.update(std::chrono::nanoseconds((i + t) % 1000));
+            }
+        });
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    const auto nanoseconds =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    return static_cast<double>(nanoseconds) / (double(thread_count) * updates_per_thread);
+}
+
+} // namespace
+
+int main() {
+    std::printf("%8s %16s %16s\n", "threads", "atomic ns/op", "mutex ns/op");
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        const double atomic = nanoseconds_per_update<mtr::atomic_block_recording>(threads);
+        const double mutex = nanoseconds_per_update<mutex_block_recording>(threads);
+        std::printf("%8d %16.2f %16.2f\n", threads, atomic, mutex);
+    }
+
+    return 0;
+}
@@ -0,0 +1,46 @@
+#include "mtr/metrics.hpp"
+
+#include <chrono>
+#include <cstdio>
+
+/*
+ * Measures the cost of METRICS_RECORD_BLOCK while collection is switched
+ * off at runtime, relative to the same loop without any instrumentation.
+ */
+
+namespace {
+
+constexpr int iterations = 50000000;
+
+volatile int sink = 0;
+
+template <typename Body>
+double nanoseconds_per_iteration(Body body) {
+    const auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        body(i);
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    const auto nanoseconds =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    return static_cast<double>(nanoseconds) / iterations;
+}
+
+} // namespace
+
+int main() {
+    mtr::metric_aggregator::instance().set_enabled(false);
+
+    const double baseline = nanoseconds_per_iteration([](int i) { sink = i; });
+    const double disabled = nanoseconds_per_iteration([](int i) {
+        METRICS_RECORD_BLOCK("disabled_block");
+        sink = i;
+    });
+
+    std::printf("baseline: %.2f ns/iteration\n", baseline);
+    std::printf("disabled: %.2f ns/iteration\n", disabled);
+    std::printf("overhead: %.2f ns/block\n", disabled - baseline);
+
+    return 0;
+}
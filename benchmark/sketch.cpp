@@ -0,0 +1,90 @@
+#include "mtr/metrics.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <random>
+#include <vector>
+
+/*
+ * Compares the update cost and the accuracy of the quantile sketch, at a
+ * few relative accuracies, and of the log-linear histogram against the
+ * exact quantiles of the sorted values. The durations are log-normally
+ * distributed and span nanoseconds to seconds.
+ */
+
+namespace {
+
+constexpr std::size_t value_count = 1000000;
+constexpr double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+std::vector<std::uint64_t> generate_values() {
+    std::mt19937_64 generator(42);
+    std::lognormal_distribution<double> distribution(10.0, 3.0);
+
+    std::vector<std::uint64_t> values(value_count);
+    for (auto &value : values) {
+        value = static_cast<std::uint64_t>(distribution(generator)) + 1;
+    }
+    return values;
+}
+
+template <typename Record>
+double nanoseconds_per_update(const std::vector<std::uint64_t> &values, Record record) {
+    const auto start = std::chrono::steady_clock::now();
+    for (const auto value : values) {
+        record(value);
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    const auto nanoseconds =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    return static_cast<double>(nanoseconds) / values.size();
+}
+
+template <typename Estimate>
+void print_errors(const std::vector<std::uint64_t> &sorted, Estimate estimate) {
+    for (const double quantile : quantiles) {
+        const auto rank = static_cast<std::size_t>(quantile * (sorted.size() - 1));
+        const double exact = static_cast<double>(sorted[rank]);
+        const double error = std::abs(estimate(quantile) - exact) / exact;
+        std::printf(" %9.3f%%", error * 100);
+    }
+    std::printf("\n");
+}
+
+} // namespace
+
+int main() {
+    const auto values = generate_values();
+    auto sorted = values;
+    std::sort(sorted.begin(), sorted.end());
+
+    std::printf("%-22s %10s", "statistic", "ns/update");
+    for (const double quantile : quantiles) {
+        std::printf(" %9.1f%%", quantile * 100);
+    }
+    std::printf("\n");
+
+    for (const double accuracy : {0.05, 0.01, 0.005}) {
+        mtr::quantile_sketch sketch(accuracy);
+        const double cost = nanoseconds_per_update(
+            values, [&sketch](std::uint64_t value) { sketch.record(static_cast<double>(value)); });
+
+        std::printf("sketch (%5.3f)         %10.2f", accuracy, cost);
+        print_errors(sorted, [&sketch](double q) { return sketch.value_at_quantile(q); });
+    }
+
+    auto histogram = std::make_unique<mtr::histogram>();
+    const double cost = nanoseconds_per_update(
+        values, [&histogram](std::uint64_t value) { histogram->record(value); });
+
+    std::printf("%-22s %10.2f", "histogram", cost);
+    print_errors(sorted, [&histogram](double q) {
+        return static_cast<double>(histogram->value_at_quantile(q));
+    });
+
+    return 0;
+}
@@ -3,217 +3,4144 @@
 #include <algorithm>
 #include <any>
 #include <array>
+#include <atomic>
 #include <chrono>
+#include <cerrno>
 #include <cmath>
 #include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <deque>
 #include <numeric>
 #include <stdexcept>
+#include <string>
+#include <string_view>
 #include <type_traits>
 #include <unordered_map>
+#include <utility>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    #define METRICS_HAS_TSC 1
+    #if defined(_MSC_VER)
+        #include <intrin.h>
+    #else
+        #include <cpuid.h>
+        #include <x86intrin.h>
+    #endif
+#else
+    #define METRICS_HAS_TSC 0
+#endif
+
+/* Number of bits of the sub-buckets every power of two is split into by
+ * mtr::histogram; values are kept with a relative error of 2^-precision. */
+#ifndef METRICS_HISTOGRAM_PRECISION
+    #define METRICS_HISTOGRAM_PRECISION 4
+#endif
+
+/* Number of events each thread can buffer while tracing, a power of two. */
+#ifndef METRICS_TRACE_EVENTS
+    #define METRICS_TRACE_EVENTS (1u << 15)
+#endif
+
+/* Number of the most recent blocks each thread keeps for the flight
+ * recorder, a power of two, and the most threads it keeps them for. */
+#ifndef METRICS_FLIGHT_RECORDER_EVENTS
+    #define METRICS_FLIGHT_RECORDER_EVENTS (1u << 12)
+#endif
+#ifndef METRICS_FLIGHT_RECORDER_THREADS
+    #define METRICS_FLIGHT_RECORDER_THREADS 256
+#endif
+
+/* Number of the slowest calls of each metric kept by mtr::slowest_calls. */
+#ifndef METRICS_SLOWEST_CALLS
+    #define METRICS_SLOWEST_CALLS 8
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+    #define METRICS_HAS_CLOCK_GETTIME 1
+    #include <time.h>
+#else
+    #define METRICS_HAS_CLOCK_GETTIME 0
+#endif
+
+/* The flight recorder writes its snapshots with async-signal-safe calls. */
+#if defined(__unix__) || defined(__APPLE__)
+    #define METRICS_HAS_POSIX_IO 1
+    #include <fcntl.h>
+    #include <signal.h>
+    #include <unistd.h>
+#else
+    #define METRICS_HAS_POSIX_IO 0
+#endif
+
+/* Coroutines are timed by mtr::basic_timed_promise where C++20 is used. */
+#if defined(__cpp_impl_coroutine) && defined(__cpp_concepts) && __has_include(<coroutine>)
+    #define METRICS_HAS_COROUTINES 1
+    #include <coroutine>
+#else
+    #define METRICS_HAS_COROUTINES 0
+#endif
 
 #if COLLECT_METRICS
-    #define METRICS_RECORD_BLOCK(metric_name)                 \
-	    mtr::collector UNIQUE_NAME(__cOlLeCtOr)((metric_name));
-    
+    /* The metric name is resolved to a handle once per call site, hence it
+     * must not change between invocations of the same call site. */
+    #define METRICS_RECORD_BLOCK(metric_name)                                  \
+	    METRICS_RECORD_BLOCK_WITH(mtr::default_clock, metric_name)
+
+    /* Records into a single recording shared by all threads, which can be
+     * read without merging shards. */
+    #define METRICS_RECORD_BLOCK_ATOMIC(metric_name)                           \
+	    METRICS_RECORD_BLOCK_WITH_STORAGE(metric_name, mtr::metric_storage::shared_atomic)
+
+    /* Times the block with the time stamp counter, see mtr::tsc_clock. */
+    #define METRICS_RECORD_BLOCK_TSC(metric_name)                              \
+	    METRICS_RECORD_BLOCK_WITH(mtr::tsc_clock, metric_name)
+
+    /* Times the block with the given clock policy, e.g. mtr::coarse_clock. */
+    #define METRICS_RECORD_BLOCK_WITH(clock, metric_name)                      \
+	    METRICS_RECORD_BLOCK_IMPL(clock, metric_name, mtr::metric_storage::thread_sharded)
+
+    /* Times one in every `period` entries of each thread. Every entry is
+     * still counted, and the total is extrapolated from the timed ones. */
+    #define METRICS_RECORD_BLOCK_SAMPLED(metric_name, period)                  \
+	    static const mtr::metric_handle UNIQUE_NAME(__hAnDlE) =               \
+	        mtr::metric_aggregator::instance().register_metric((metric_name)); \
+	    mtr::collector UNIQUE_NAME(__cOlLeCtOr)(UNIQUE_NAME(__hAnDlE), (period));
+
+    /* Additionally keeps a quantile sketch of the durations, see
+     * metric_aggregator::register_sketched_metric. */
+    #define METRICS_RECORD_BLOCK_SKETCHED(metric_name, relative_accuracy)      \
+	    static const mtr::metric_handle UNIQUE_NAME(__hAnDlE) =               \
+	        mtr::metric_aggregator::instance().register_sketched_metric(      \
+	            (metric_name), (relative_accuracy));                          \
+	    mtr::collector UNIQUE_NAME(__cOlLeCtOr)(UNIQUE_NAME(__hAnDlE));
+
+    /* Sampled with a period that the overhead governor adjusts so that the
+     * cost of instrumentation stays within the configured CPU budget. */
+    #define METRICS_RECORD_BLOCK_ADAPTIVE(metric_name)                         \
+	    static const mtr::metric_handle UNIQUE_NAME(__hAnDlE) =               \
+	        mtr::metric_aggregator::instance().register_adaptive_metric((metric_name)); \
+	    mtr::collector UNIQUE_NAME(__cOlLeCtOr)(UNIQUE_NAME(__hAnDlE), mtr::adaptive_sampling);
+
+    /* Adds `delta` to a counter, e.g. the bytes sent on a socket. */
+    #define METRICS_COUNT(metric_name, delta)                                  \
+	    static const mtr::metric_handle UNIQUE_NAME(__hAnDlE) =               \
+	        mtr::metric_aggregator::instance().register_counter((metric_name)); \
+	    mtr::metric_aggregator::instance().increment(UNIQUE_NAME(__hAnDlE), (delta));
+
+    /* Sets a gauge to its current `value`, e.g. the depth of a queue. */
+    #define METRICS_GAUGE(metric_name, value)                                  \
+	    static const mtr::metric_handle UNIQUE_NAME(__hAnDlE) =               \
+	        mtr::metric_aggregator::instance().register_gauge((metric_name)); \
+	    mtr::metric_aggregator::instance().set_gauge(UNIQUE_NAME(__hAnDlE), (value));
+
+    /* Records a quantity other than a duration, e.g. the size of a request,
+     * into a histogram with the same statistics as timed blocks. */
+    #define METRICS_RECORD_VALUE(metric_name, value)                           \
+	    METRICS_RECORD_VALUE_WITH_UNIT(metric_name, value, "")
+
+    /* The unit is appended to the values in dumps, e.g. "B" or " rows". */
+    #define METRICS_RECORD_VALUE_WITH_UNIT(metric_name, value, unit)           \
+	    static const mtr::metric_handle UNIQUE_NAME(__hAnDlE) =               \
+	        mtr::metric_aggregator::instance().register_value_metric((metric_name), (unit)); \
+	    mtr::metric_aggregator::instance().record_value(UNIQUE_NAME(__hAnDlE), (value));
+
+    /* Times the rest of a coroutine whose promise type derives from
+     * mtr::basic_timed_promise, split into "<metric_name>.active" and
+     * "<metric_name>.suspended", which are recorded when the body finishes. */
+    #define METRICS_RECORD_COROUTINE(metric_name)                              \
+	    static const mtr::coroutine_metric UNIQUE_NAME(__hAnDlE) =            \
+	        mtr::metric_aggregator::instance().register_coroutine((metric_name)); \
+	    const auto UNIQUE_NAME(__sCoPe) = co_await UNIQUE_NAME(__hAnDlE);
+
+    #define METRICS_RECORD_BLOCK_WITH_STORAGE(metric_name, storage)            \
+	    METRICS_RECORD_BLOCK_IMPL(mtr::default_clock, metric_name, storage)
+
+    #define METRICS_RECORD_BLOCK_IMPL(clock, metric_name, storage)             \
+	    static const mtr::metric_handle UNIQUE_NAME(__hAnDlE) =               \
+	        mtr::metric_aggregator::instance().register_metric((metric_name), (storage)); \
+	    mtr::basic_collector<clock> UNIQUE_NAME(__cOlLeCtOr)(UNIQUE_NAME(__hAnDlE));
+
     #define UNIQUE_NUM __LINE__
     #define CAT(X, Y) CAT_IMP(X, Y)
-    #define CAT_IMP(x, Y) X##Y
+    #define CAT_IMP(X, Y) X##Y
     #define UNIQUE_NAME(X) CAT(X, UNIQUE_NUM)
 #else
     #define METRICS_RECORD_BLOCK(metric_name)
+    #define METRICS_RECORD_BLOCK_ATOMIC(metric_name)
+    #define METRICS_RECORD_BLOCK_TSC(metric_name)
+    #define METRICS_RECORD_BLOCK_WITH(clock, metric_name)
+    #define METRICS_RECORD_BLOCK_SAMPLED(metric_name, period)
+    #define METRICS_RECORD_BLOCK_ADAPTIVE(metric_name)
+    #define METRICS_RECORD_BLOCK_SKETCHED(metric_name, relative_accuracy)
+    #define METRICS_COUNT(metric_name, delta)
+    #define METRICS_GAUGE(metric_name, value)
+    #define METRICS_RECORD_VALUE(metric_name, value)
+    #define METRICS_RECORD_VALUE_WITH_UNIT(metric_name, value, unit)
+    #define METRICS_RECORD_COROUTINE(metric_name)
+    #define METRICS_RECORD_BLOCK_WITH_STORAGE(metric_name, storage)
 #endif
 
 namespace mtr {
 
+namespace detail {
+
+/* Number of leading zero bits of a non-zero value. */
+int leading_zeros(std::uint64_t value);
+
+/* The 128 bit product of two values, as its low word and, in `high`, its
+ * high word. */
+std::uint64_t multiply_wide(std::uint64_t lhs, std::uint64_t rhs, std::uint64_t &high);
+
+/* The sum of two durations, clamped to the range of nanoseconds rather
+ * than overflowing, so that totals of large values saturate. */
+std::chrono::nanoseconds saturating_add(std::chrono::nanoseconds lhs, std::chrono::nanoseconds rhs);
+
+/* Recorded values are kept as fixed point in the nanoseconds of a
+ * recording, with this many steps per unit. Values are rounded to the
+ * nearest step and larger ones than max_value saturate. */
+constexpr std::int64_t value_scale = 1000;
+constexpr std::int64_t max_value = std::numeric_limits<std::int64_t>::max() / value_scale;
+
+/* Converts the nanoseconds of a recording to T: a duration, or an arithmetic
+ * type for value metrics. */
+template <typename T>
+T quantity_cast(std::chrono::nanoseconds quantity);
+
+template <typename T>
+double nanoseconds_per_unit();
+
+/* The count of a duration, or an arithmetic value as is. */
+template <typename T>
+auto count_of(T quantity);
+
+} // namespace detail
+
+/* Log-linear histogram. Every power of two range is split into
+ * 2^Precision equally wide buckets and values below 2^Precision get a
+ * bucket each. Memory is fixed and recording never allocates. */
+template <unsigned Precision>
+class basic_histogram {
+public:
+	static constexpr std::size_t sub_bucket_count = std::size_t{1} << Precision;
+	static constexpr std::size_t bucket_count = (65 - Precision) * sub_bucket_count;
+
+	static std::size_t bucket_index(std::uint64_t value);
+	static std::uint64_t bucket_lower_bound(std::size_t index);
+	static std::uint64_t bucket_upper_bound(std::size_t index);
+
+	void record(std::uint64_t value);
+	void add_to_bucket(std::size_t index, std::uint64_t count);
+	void merge(const basic_histogram &other);
+
+	std::uint64_t count() const;
+	std::uint64_t bucket(std::size_t index) const;
+
+	/* Midpoint of the bucket holding the value at the given quantile, with
+	 * the quantile in [0, 1]. Returns 0 when the histogram is empty. */
+	std::uint64_t value_at_quantile(double quantile) const;
+
+private:
+	std::array<std::uint64_t, bucket_count> buckets_{};
+	std::uint64_t count_ = 0;
+};
+
+using histogram = basic_histogram<METRICS_HISTOGRAM_PRECISION>;
+
+/*
+ * DDSketch quantile sketch. Positive values are mapped to logarithmically
+ * sized bins, so every quantile is estimated within the given relative
+ * accuracy regardless of the range the values span. The bins are a fixed
+ * window; if values span more than it covers, the lowest bins are collapsed
+ * together, which keeps memory bounded at the price of accuracy for the low
+ * quantiles only. Sketches with the same accuracy merge exactly.
+ */
+class quantile_sketch {
+public:
+	static constexpr std::size_t max_bins = 2048;
+
+	explicit quantile_sketch(double relative_accuracy = 0.01);
+
+	void record(double value);
+	void merge(const quantile_sketch &other);
+
+	std::uint64_t count() const;
+	double relative_accuracy() const;
+
+	/* Estimate of the value at the given quantile in [0, 1]. Returns 0 when
+	 * the sketch is empty. */
+	double value_at_quantile(double quantile) const;
+
+private:
+	int key(double value) const;
+	double value(int key) const;
+	void add(int key, std::uint64_t count);
+
+	/* Moves the window so that it starts at `offset`, collapsing the bins
+	 * that fall below it into the lowest one. */
+	void shift_window(int offset);
+
+private:
+	double relative_accuracy_;
+	double gamma_;
+	double log_gamma_;
+
+	std::array<std::uint64_t, max_bins> bins_{};
+	int offset_ = 0;
+	int min_key_ = 0;
+	int max_key_ = 0;
+
+	std::uint64_t zero_count_ = 0;
+	std::uint64_t count_ = 0;
+};
+
 class block_recording {
 public:
 	void update(std::chrono::nanoseconds elapsed);
+	void merge(const block_recording &other);
+
+	/* Counts entries of a sampled block that were not timed. */
+	void count_unsampled(std::uint64_t entries);
 
 	std::size_t times_entered() const;
+	std::size_t times_sampled() const;
+
+	/* When not every entry was timed, the total is extrapolated from the
+	 * average of the timed ones. */
     std::chrono::nanoseconds total() const;
     std::chrono::nanoseconds min() const;
     std::chrono::nanoseconds max() const;
 
+	/* Estimated from the histogram of the timed entries, with the quantile
+	 * in [0, 1]. */
+	std::chrono::nanoseconds percentile(double quantile) const;
+	const histogram &distribution() const;
+
+	/* Population variance (in ns^2) and standard deviation of the timed
+	 * entries, tracked with Welford's online algorithm. */
+	double variance() const;
+	std::chrono::nanoseconds stddev() const;
+
+private:
+	friend class atomic_block_recording;
+
 private:
 	std::uint64_t times_entered_ = 0;
+	std::uint64_t times_sampled_ = 0;
     std::chrono::nanoseconds total_ = std::chrono::nanoseconds(0);
     std::chrono::nanoseconds min_ = std::chrono::nanoseconds::max();
     std::chrono::nanoseconds max_ = std::chrono::nanoseconds::min();
+	histogram histogram_;
+
+	/* Running mean and sum of squared deviations from it. */
+	double mean_ = 0.0;
+	double m2_ = 0.0;
+};
+
+/* Counterpart of block_recording that many threads can update concurrently.
+ * Count and total are relaxed fetch_adds; min and max are CAS loops that
+ * only retry when the new value actually improves on the current one.
+ * Welford's algorithm cannot be updated atomically, so the variance is
+ * derived from a sum of squares instead, which is less precise when the
+ * deviation is tiny compared to the mean. The sum is a 128 bit integer of
+ * ns^2 kept in two words, each updated with a fetch_add, the carry out of
+ * the low word going to the high one, so that updates never retry. The
+ * total is kept the same way, so that it saturates when loaded rather than
+ * wrapping around. */
+class atomic_block_recording {
+public:
+	void update(std::chrono::nanoseconds elapsed);
+
+	block_recording load() const;
+
+private:
+	std::atomic<std::uint64_t> times_entered_{0};
+	std::atomic<std::uint64_t> total_low_{0};
+	std::atomic<std::uint64_t> total_high_{0};
+	std::atomic<std::int64_t> min_{std::chrono::nanoseconds::max().count()};
+	std::atomic<std::int64_t> max_{std::chrono::nanoseconds::min().count()};
+	std::array<std::atomic<std::uint64_t>, histogram::bucket_count> buckets_{};
+	std::atomic<std::uint64_t> sum_of_squares_low_{0};
+	std::atomic<std::uint64_t> sum_of_squares_high_{0};
+};
+
+/* Count, total, min and max of the entries recorded in some period. */
+class interval_recording {
+public:
+	void update(std::chrono::nanoseconds elapsed);
+	void merge(const interval_recording &other);
+
+	std::size_t times_entered() const;
+	std::chrono::nanoseconds total() const;
+	std::chrono::nanoseconds min() const;
+	std::chrono::nanoseconds max() const;
+
+private:
+	std::uint64_t times_entered_ = 0;
+	std::chrono::nanoseconds total_ = std::chrono::nanoseconds(0);
+	std::chrono::nanoseconds min_ = std::chrono::nanoseconds::max();
+	std::chrono::nanoseconds max_ = std::chrono::nanoseconds::min();
+};
+
+/* Ring of interval_recordings covering the last interval_count intervals.
+ * There is no background thread: the ring is rotated lazily when an entry
+ * lands in an interval whose slot still holds an older one. */
+class window_recording {
+public:
+	static constexpr std::size_t interval_count = 60;
+	static constexpr std::chrono::nanoseconds interval = std::chrono::seconds(1);
+	static constexpr std::chrono::nanoseconds span = interval * interval_count;
+
+	/* `now` is in nanoseconds on mtr::coarse_clock. */
+	void update(std::chrono::nanoseconds elapsed, std::uint64_t now);
+	void merge(const window_recording &other);
+
+	/* Merges the intervals that overlap the `last` period before `now`,
+	 * which is capped at the span of the window. */
+	interval_recording summary(std::chrono::nanoseconds last, std::uint64_t now) const;
+
+private:
+	static constexpr std::uint64_t no_interval = ~std::uint64_t{0};
+
+	struct slot {
+		std::uint64_t index = no_interval;
+		interval_recording recording;
+	};
+
+	std::array<slot, interval_count> slots_{};
+};
+
+/* A single call of a block, kept because it was among the slowest. */
+struct slow_call {
+	std::chrono::nanoseconds elapsed{0};
+	/* When the call finished. */
+	std::chrono::system_clock::time_point timestamp;
+	std::thread::id thread;
+	/* The context the thread had set with mtr::set_call_context. */
+	std::uint64_t context = 0;
+};
+
+/* The `capacity` slowest calls, kept in a min-heap so that a call only needs
+ * to be compared against the fastest of them to be turned away. */
+class slowest_calls {
+public:
+	static constexpr std::size_t capacity = METRICS_SLOWEST_CALLS;
+
+	/* Whether a call that took `elapsed` would be kept. */
+	bool admits(std::chrono::nanoseconds elapsed) const;
+
+	void insert(const slow_call &call);
+	void merge(const slowest_calls &other);
+
+	/* The kept calls, slowest first. */
+	std::vector<slow_call> sorted() const;
+
+private:
+	std::array<slow_call, capacity> calls_{};
+	std::size_t size_ = 0;
+};
+
+/* Sets the context, e.g. a request id, recorded with the slowest calls of
+ * the calling thread until it is set again. */
+void set_call_context(std::uint64_t context);
+std::uint64_t call_context();
+
+enum class decay_horizon { one_minute, five_minutes, fifteen_minutes };
+
+/* Exponentially decaying count and total of entries over the horizons of a
+ * load average. The decay is applied lazily when an entry arrives, so there
+ * is no timer; as the coarse clock only ticks every few milliseconds, most
+ * entries do not decay anything. Recordings merge exactly by decaying both
+ * to the later time stamp. */
+class decaying_recording {
+public:
+	static constexpr std::array<std::chrono::seconds, 3> horizons = {
+	    std::chrono::minutes(1), std::chrono::minutes(5), std::chrono::minutes(15)};
+
+	/* `now` is in nanoseconds on mtr::coarse_clock. */
+	void update(std::chrono::nanoseconds elapsed, std::uint64_t now);
+	void merge(const decaying_recording &other);
+
+	/* Decayed entries per second as of `now`. */
+	double rate(decay_horizon horizon, std::uint64_t now) const;
+
+	/* Mean duration weighted towards recent entries; decay does not change it. */
+	std::chrono::nanoseconds average(decay_horizon horizon) const;
+
+private:
+	void decay_to(std::uint64_t now);
+	static double decay_factor(std::size_t horizon, std::uint64_t elapsed);
+
+	std::uint64_t last_ = 0;
+	std::array<double, horizons.size()> counts_{};
+	std::array<double, horizons.size()> totals_{};
+};
+
+/*
+ * Tree of the timed blocks by the path of blocks they were nested in. A node
+ * stands for a metric entered from its parent node, so the same metric has
+ * one node per distinct path. Node `root` stands for no block at all. Nodes
+ * are only ever added, and a parent is always added before its children.
+ */
+class call_tree {
+public:
+	using node_id = std::uint32_t;
+	static constexpr node_id root = 0;
+
+	struct node {
+		/* View into the name of the metric, which lives as long as the
+		 * aggregator. Empty for the root. */
+		std::string_view name;
+		std::size_t metric = 0;
+		node_id parent = root;
+		std::vector<node_id> children;
+
+		std::uint64_t times_entered = 0;
+		/* Time spent in the block, and the part of it spent in timed blocks
+		 * nested in it. */
+		std::chrono::nanoseconds inclusive{0};
+		std::chrono::nanoseconds nested{0};
+
+		/* Time spent in the block itself. Blocks timed with different clocks,
+		 * e.g. a coarse_clock block around steady_clock ones, can report more
+		 * nested time than inclusive time, in which case it is 0. */
+		std::chrono::nanoseconds self() const;
+	};
+
+	call_tree();
+
+	const node &at(node_id id) const;
+	std::size_t size() const;
+
+	/* The child of `parent` for the given metric, or `root` if there is none. */
+	node_id find_child(node_id parent, std::size_t metric) const;
+	node_id add_child(node_id parent, std::size_t metric, std::string_view name);
+
+	/* Records an entry of the node that took `elapsed`, which is also time
+	 * nested in its parent. */
+	void record(node_id id, std::chrono::nanoseconds elapsed);
+
+	/* Adds up the nodes of the same paths. */
+	void merge(const call_tree &other);
+
+private:
+	std::deque<node> nodes_;
+};
+
+/* What the lines of a folded stack dump are weighted by. */
+enum class folded_weight {
+	/* Nanoseconds spent in the block itself. */
+	self_time,
+	/* Entries of the block on that path. */
+	count
+};
+
+/* A flight recorder snapshot read back from its file. */
+struct flight_recording {
+	struct event {
+		std::uint32_t thread;
+		std::size_t metric;
+		/* Since tracing or flight recording was first switched on. */
+		std::chrono::nanoseconds start;
+		std::chrono::nanoseconds duration;
+	};
+
+	/* Oldest first for each thread. */
+	std::vector<event> events;
+	/* Names of the metrics, by id. */
+	std::unordered_map<std::size_t, std::string> names;
+
+	/* Throws std::runtime_error if the stream does not hold a snapshot. */
+	static flight_recording read(std::istream &stream);
+};
+
+enum class metric_storage {
+	/* Every thread records into its own shard; shards are merged on read. */
+	thread_sharded,
+	/* All threads record into one atomic_block_recording. */
+	shared_atomic
+};
+
+enum class metric_kind {
+	/* Durations of timed blocks. */
+	timer,
+	/* A sum of deltas, kept per thread and summed on read. */
+	counter,
+	/* The last value that was set. */
+	gauge,
+	/* Distribution of recorded quantities, stored like durations. */
+	value
+};
+
+namespace detail {
+
+/* What is kept of the timed entries of a metric, by a shard or for the
+ * threads that exited. It takes a few kilobytes, mostly for the histogram,
+ * so it is only allocated once there is something to keep. */
+struct block_recordings {
+	void merge(const block_recordings &other);
+
+	block_recording recording;
+
+	/* Only allocated for metrics that keep a sketch. */
+	std::unique_ptr<quantile_sketch> sketch;
+
+	/* The recent history of the metric. */
+	window_recording window;
+	decaying_recording decaying;
+	slowest_calls slowest;
+};
+
+struct metric_info {
+	metric_info(std::size_t id, std::string_view name, metric_kind kind);
+
+	std::size_t id;
+	std::string name;
+	metric_kind kind;
+	/* Unit of a value metric, printed after its values. */
+	std::string unit;
+	std::unique_ptr<atomic_block_recording> atomic;
+
+	/* Whether the metric itself is switched on, and whether it is actually
+	 * collected, i.e. the metric and collection as a whole are switched on.
+	 * Keeping the latter precomputed lets collectors check a single flag. */
+	std::atomic<bool> enabled{true};
+	std::atomic<bool> active{true};
+
+	/* Set for metrics whose sampling period is chosen by the overhead
+	 * governor. The entry count is the one seen at the last rebalance and is
+	 * guarded by the aggregator's mutex. */
+	std::atomic<bool> adaptive{false};
+	std::uint64_t governed_entries = 0;
+	std::atomic<std::uint32_t> sampling_period{1};
+
+	/* Relative accuracy of the quantile sketch kept for the metric, or 0
+	 * when it does not keep one. */
+	std::atomic<double> sketch_accuracy{0.0};
+
+	/* Recordings of the threads that exited, guarded by the aggregator's
+	 * mutex. Allocated when the first thread that entered the metric exits. */
+	std::unique_ptr<block_recordings> retired;
+
+	/* False while the metric was only named by set_enabled, so that its
+	 * first registration still decides its storage and kind. Guarded by the
+	 * aggregator's mutex. */
+	bool registered = true;
+
+	/* Counters are numbered apart from the other metrics, so that a thread
+	 * keeps a plain count per counter rather than a slot per metric. */
+	std::size_t counter_index = 0;
+
+	/* Counts of the threads that exited, guarded by the aggregator's mutex. */
+	std::int64_t retired_count = 0;
+
+	/* A set is a plain store, so gauges need no sharding. */
+	std::atomic<double> gauge{0.0};
+
+	/* The last flight recorder snapshot that wrote the metric's name. */
+	mutable std::atomic<std::uint64_t> flight_snapshot{0};
+};
+
+/* A timed block, as buffered while tracing. The start is in mtr::tsc_clock
+ * ticks so that the events of all threads share one timeline. */
+struct trace_event {
+	std::uint64_t start;
+	std::uint64_t duration;
+	std::size_t metric;
+};
+
+/* Preallocated single producer, single consumer queue of the trace events
+ * of one thread. The owner pushes with a few stores and no lock; events
+ * that do not fit are dropped and counted rather than overwriting events
+ * the consumer may be reading. */
+class trace_ring {
+public:
+	static constexpr std::size_t capacity = METRICS_TRACE_EVENTS;
+	static_assert((capacity & (capacity - 1)) == 0, "METRICS_TRACE_EVENTS must be a power of two");
+
+	explicit trace_ring(std::uint32_t thread);
+
+	/* Owning thread only. */
+	void push(const trace_event &event);
+
+	/* Calls `consume` with every buffered event, oldest first, and frees
+	 * their space. Must not be called concurrently with itself. */
+	template <typename Consumer>
+	void drain(Consumer &&consume);
+
+	std::uint32_t thread() const;
+	std::uint64_t dropped() const;
+
+private:
+	std::unique_ptr<trace_event[]> events_;
+	std::atomic<std::uint64_t> head_{0};
+	std::atomic<std::uint64_t> tail_{0};
+	std::atomic<std::uint64_t> dropped_{0};
+	std::uint32_t thread_;
+};
+
+/* Ring of the most recent blocks of a thread, for the flight recorder. The
+ * owner overwrites the oldest record with a few stores and no lock. Each
+ * record is guarded by a sequence number, so that a snapshot taken while
+ * it is being overwritten skips it rather than reading a torn record.
+ * Rings are never freed: a ring whose thread exited keeps its records until
+ * a new thread takes it over, which bounds the memory by the number of
+ * threads alive at once. */
+class flight_ring {
+public:
+	static constexpr std::size_t capacity = METRICS_FLIGHT_RECORDER_EVENTS;
+	static_assert((capacity & (capacity - 1)) == 0,
+	              "METRICS_FLIGHT_RECORDER_EVENTS must be a power of two");
+
+	struct record {
+		const metric_info *info;
+		std::uint32_t thread;
+		std::uint64_t start;
+		std::uint64_t duration;
+	};
+
+	flight_ring();
+
+	/* Owning thread only. */
+	void push(const record &entry);
+
+	/* Calls `consume` with a copy of every record that is not being
+	 * overwritten, oldest first. Lock free and async-signal-safe. */
+	template <typename Consumer>
+	void snapshot(Consumer &&consume) const;
+
+	/* Whether a live thread owns the ring. */
+	std::atomic<bool> in_use{true};
+
+private:
+	struct slot {
+		std::atomic<std::uint64_t> sequence{0};
+		std::atomic<const metric_info *> info{nullptr};
+		std::atomic<std::uint32_t> thread{0};
+		std::atomic<std::uint64_t> start{0};
+		std::atomic<std::uint64_t> duration{0};
+	};
+
+	std::unique_ptr<slot[]> slots_;
+	std::atomic<std::uint64_t> head_{0};
+};
+
+/* Layout of a flight recording file: the header, then entries in the byte
+ * order of the machine that wrote it. The entry of a metric's name is
+ * followed by the name itself and comes before the metric's first event. */
+struct flight_file_entry {
+	enum tag_type : std::uint32_t { event_tag = 1, name_tag = 2 };
+
+	std::uint32_t tag;
+	/* The thread of an event, or the length of a name. */
+	std::uint32_t thread_or_length;
+	std::uint64_t metric;
+	/* Nanoseconds since tracing started, and of the block. */
+	std::uint64_t start;
+	std::uint64_t duration;
+};
+
+struct flight_file_header {
+	char magic[8] = {'M', 'T', 'R', 'F', 'L', 'I', 'T', 'E'};
+	std::uint32_t version = 1;
+	std::uint32_t entry_size = sizeof(flight_file_entry);
+};
+
+#if METRICS_HAS_POSIX_IO
+inline char flight_recording_path[4096];
+void flight_recording_signal_handler(int signal);
+#endif
+
+/* Writes the fields of a protocol buffer message in the wire format. */
+class proto_writer {
+public:
+	void varint_field(std::uint32_t field, std::uint64_t value);
+	void string_field(std::uint32_t field, std::string_view value);
+	void message_field(std::uint32_t field, const proto_writer &message);
+
+	const std::string &bytes() const;
+	void clear();
+
+private:
+	enum wire_type : std::uint32_t { varint_type = 0, length_delimited_type = 2 };
+
+	void varint(std::uint64_t value);
+
+	std::string bytes_;
+};
+
+/* Lock guarding a per-thread shard. It is only ever contended while a reader
+ * merges the shards, so spinning is cheaper than going through a mutex. */
+class spin_lock {
+public:
+	void lock();
+	void unlock();
+
+private:
+	std::atomic<bool> locked_{false};
+};
+
+struct shard_slot {
+	/* Allocated by the owning thread on the first timed entry, so that
+	 * metrics a thread does not time cost it little. Guarded by the shard's
+	 * lock, but the owner may check whether it is allocated without it. */
+	std::unique_ptr<block_recordings> timed;
+
+	/* Entries of a sampled block that were not timed. Only the owning thread
+	 * writes it, and it does so without taking the lock. */
+	std::atomic<std::uint64_t> unsampled{0};
+
+	/* Entries left until a sampled block is timed again. Owning thread only. */
+	std::uint32_t countdown = 0;
+};
+
+struct shard;
+
+/* A block entered in a thread's call tree, as kept by its collector so that
+ * it exits the same node, even when collectors do not nest or the block ends
+ * on another thread. */
+struct block_frame {
+	/* Stands in for an entry that was not timed, e.g. of a sampled block, so
+	 * that the blocks nested in it are not attached to its parent. */
+	static constexpr call_tree::node_id untimed = std::numeric_limits<call_tree::node_id>::max();
+
+	/* A new thread's shard may reuse the address of an exited one, so the
+	 * owner is told apart by its number as well. */
+	shard *owner = nullptr;
+	std::uint32_t owner_number = 0;
+	call_tree::node_id node = call_tree::root;
+};
+
+/* Cost of a timed and of a skipped entry of a collector, measured once on
+ * the calling thread, through the recording path of collectors. */
+struct instrumentation_cost {
+	static const instrumentation_cost &measured();
+
+	double timed_nanoseconds;
+	double skipped_nanoseconds;
+};
+
+struct shard {
+	/* Returns the slot of a metric, growing the shard when needed. Must only
+	 * be called from the thread that owns the shard. */
+	shard_slot &slot(std::size_t id);
+
+	/* Returns the count of a counter, by counter index, growing the counts
+	 * when needed. Must only be called from the thread that owns the shard. */
+	std::atomic<std::int64_t> &count(std::size_t index);
+
+	/* The recordings of a metric's timed entries, or null if the thread has
+	 * not timed it. The lock must be held. */
+	const block_recordings *timed(std::size_t id) const;
+
+	spin_lock lock;
+
+	/* Entries of adaptive blocks, used to decide when to check whether the
+	 * sampling periods are due to be rebalanced. Owning thread only. */
+	std::uint32_t adaptive_entries = 0;
+
+	/* Slots never move once created, so that the owner can access them
+	 * without the lock while a reader is merging. */
+	std::deque<shard_slot> slots;
+
+	/* Sums of the deltas of the counters. Only the owning thread writes
+	 * them, and it does so without taking the lock. */
+	std::deque<std::atomic<std::int64_t>> counts;
+
+	/* The thread's call tree; only the owner changes it, under the lock.
+	 * The stack holds the nodes of the blocks being timed, innermost last,
+	 * and is owning thread only. */
+	call_tree tree;
+	std::vector<call_tree::node_id> stack;
+
+	/* Nodes of blocks this thread entered that exited on another one, e.g.
+	 * in a coroutine resumed elsewhere, for the owner to take off its stack.
+	 * Guarded by the lock; the flag tells the owner there are some. */
+	std::vector<call_tree::node_id> orphans;
+	std::atomic<bool> has_orphans{false};
+
+	/* Takes the innermost occurrence of a node off the stack, if any.
+	 * Owning thread only. */
+	bool unwind(call_tree::node_id node);
+	void drop_orphans();
+
+	/* Allocated by the owner, under the aggregator's mutex, on its first
+	 * traced block. */
+	std::unique_ptr<trace_ring> trace;
+
+	/* Taken by the owner, under the aggregator's mutex, on its first block
+	 * while flight recording, and handed back when the thread exits. Null
+	 * if all METRICS_FLIGHT_RECORDER_THREADS rings were taken. */
+	flight_ring *flight = nullptr;
+	bool flight_taken = false;
+
+	/* Number of the thread in traces and call tree frames, from 1 in order
+	 * of registration, so that no two shards share one. */
+	std::uint32_t number = 0;
+};
+
+} // namespace detail
+
+class metric_handle {
+public:
+	std::size_t id() const;
+
+	/* Whether blocks recorded through this handle are currently collected. */
+	bool is_active() const;
+
+	/* The period chosen by the overhead governor for adaptive metrics. */
+	std::uint32_t sampling_period() const;
+
+private:
+	friend class metric_aggregator;
+	explicit metric_handle(detail::metric_info *info);
+
+private:
+	detail::metric_info *info_;
+};
+
+/*
+ * Clock policies used to time blocks. A policy provides:
+ *
+ *  static std::uint64_t now();
+ *      A time stamp in the clock's own ticks.
+ *  static std::chrono::nanoseconds to_nanoseconds(std::uint64_t ticks);
+ *      Converts a difference of two time stamps to nanoseconds.
+ */
+
+/* Adapts a std::chrono clock to the clock policy interface. */
+template <typename Clock>
+class chrono_clock {
+public:
+	static std::uint64_t now();
+	static std::chrono::nanoseconds to_nanoseconds(std::uint64_t ticks);
+};
+
+using steady_clock = chrono_clock<std::chrono::steady_clock>;
+using high_resolution_clock = chrono_clock<std::chrono::high_resolution_clock>;
+
+/* CLOCK_MONOTONIC_COARSE where available. It only advances once per
+ * scheduler tick (typically 1-4ms) but is several times cheaper to read,
+ * which makes it suitable for long blocks such as I/O. */
+class coarse_clock {
+public:
+	static std::uint64_t now();
+	static std::chrono::nanoseconds to_nanoseconds(std::uint64_t ticks);
+};
+
+/* CPU time consumed by the calling thread, so time spent blocked or
+ * descheduled is not counted. Blocks must start and end on one thread. */
+class thread_cpu_clock {
+public:
+	static std::uint64_t now();
+	static std::chrono::nanoseconds to_nanoseconds(std::uint64_t ticks);
+};
+
+/* CPU time consumed by the whole process. */
+class process_cpu_clock {
+public:
+	static std::uint64_t now();
+	static std::chrono::nanoseconds to_nanoseconds(std::uint64_t ticks);
 };
 
-class high_resolution_timer {
-public:
-	explicit high_resolution_timer();
+/* A clock that only moves when told to, for deterministic tests. */
+class virtual_clock {
+public:
+	static std::uint64_t now();
+	static std::chrono::nanoseconds to_nanoseconds(std::uint64_t ticks);
+
+	static void set(std::chrono::nanoseconds time);
+	static void advance(std::chrono::nanoseconds duration);
+
+private:
+	static std::atomic<std::uint64_t> &time();
+};
+
+/* Reads the time stamp counter when the CPU advertises an invariant one and
+ * falls back to std::chrono::steady_clock otherwise. Time stamps are raw
+ * ticks; they are only converted to nanoseconds when an elapsed time is
+ * requested, using a ratio calibrated against steady_clock on first use. */
+class tsc_clock {
+public:
+	static std::uint64_t now();
+	static std::chrono::nanoseconds to_nanoseconds(std::uint64_t ticks);
+
+	/* Also reports the processor that the time stamp was read on, or
+	 * any_cpu when it is not read from the time stamp counter, in which case
+	 * time stamps taken on different processors can be compared. */
+	static constexpr std::uint32_t any_cpu = ~std::uint32_t{0};
+	static std::uint64_t now(std::uint32_t &cpu);
+
+	/* Whether time stamps come from the time stamp counter. */
+	static bool is_invariant();
+
+private:
+	struct calibration {
+		bool invariant;
+		double nanoseconds_per_tick;
+	};
+
+	static const calibration &calibrated();
+	static bool detect_invariant_tsc();
+	static std::uint64_t read_tsc();
+	static std::uint64_t read_tsc(std::uint32_t &cpu);
+	static std::uint64_t read_steady_clock();
+};
+
+using default_clock = steady_clock;
+
+template <typename Clock>
+class basic_timer {
+public:
+	explicit basic_timer();
+
+	void restart();
+    std::chrono::nanoseconds elapsed() const;
+
+private:
+	std::uint64_t start_time_;
+};
+
+using high_resolution_timer = basic_timer<high_resolution_clock>;
+using tsc_timer = basic_timer<tsc_clock>;
+
+/* Tag selecting the sampling period chosen by the overhead governor. */
+struct adaptive_sampling_t {};
+inline constexpr adaptive_sampling_t adaptive_sampling{};
+
+template <typename Clock>
+class basic_collector {
+public:
+	explicit basic_collector(metric_handle handle);
+	explicit basic_collector(std::string_view metric_name);
+
+	/* Times only one in every `sampling_period` entries of the calling
+	 * thread, see metric_aggregator::sample_entry. */
+	basic_collector(metric_handle handle, std::uint32_t sampling_period);
+
+	/* Samples with the period the overhead governor chose for the metric. */
+	basic_collector(metric_handle handle, adaptive_sampling_t);
+
+	~basic_collector();
+
+private:
+	void start();
+
+	metric_handle handle_;
+
+	/* Only engaged when collection was active on entry. */
+	std::optional<basic_timer<Clock>> timer_;
+
+	/* mtr::tsc_clock time stamp of the entry when tracing, otherwise 0. */
+	std::uint64_t trace_start_ = 0;
+
+	detail::block_frame frame_;
+};
+
+using collector = basic_collector<default_clock>;
+using tsc_collector = basic_collector<tsc_clock>;
+
+template <typename Clock>
+class basic_span;
+
+template <typename Clock = default_clock>
+basic_span<Clock> start(metric_handle handle);
+
+/* Records the span, if it is active, and returns how long it took. */
+template <typename Clock>
+std::chrono::nanoseconds stop(basic_span<Clock> &span);
+
+/*
+ * Times a region that is not a lexical scope, e.g. from one callback to
+ * another: mtr::start returns a span and mtr::stop records it through the
+ * same path as a collector. Spans are movable and never allocate. A span
+ * that is never stopped records nothing. Stopping a span that was moved
+ * from, already stopped, or started while its metric was not collected does
+ * nothing. Spans need not nest, so they are not part of the call tree.
+ *
+ * A span may be stopped on another thread than the one that started it,
+ * e.g. submitted on an IO thread and completed on a worker, as long as it
+ * is handed over with the usual synchronisation. It is then recorded in
+ * the shard of the thread that stops it, so it contends with no one. The
+ * time stamp counters of different processors need not agree, so a
+ * tsc_clock span that stops on another processor than it started on is
+ * timed with the steady clock instead, which it also reads on start. A
+ * clock that only counts the time of the calling thread, thread_cpu_clock,
+ * cannot time such a span and is rejected at compile time.
+ */
+template <typename Clock>
+class basic_span {
+	static_assert(not std::is_same_v<Clock, thread_cpu_clock>,
+	              "spans may stop on another thread, so they cannot use a per-thread clock");
+
+public:
+	basic_span() = default;
+	basic_span(basic_span &&other) noexcept;
+	basic_span &operator=(basic_span &&other) noexcept;
+
+	basic_span(const basic_span &) = delete;
+	basic_span &operator=(const basic_span &) = delete;
+
+	/* Whether stopping the span records it. */
+	bool is_active() const;
+
+private:
+	friend basic_span start<Clock>(metric_handle handle);
+	friend std::chrono::nanoseconds stop<Clock>(basic_span &span);
+
+	static constexpr bool per_cpu_clock = std::is_same_v<Clock, tsc_clock>;
+
+	std::chrono::nanoseconds elapsed() const;
+
+	/* Only engaged while the span is active. */
+	std::optional<metric_handle> handle_;
+	std::uint64_t start_ = 0;
+
+	/* Processor and steady clock time stamp of the start, for tsc_clock. */
+	std::uint32_t cpu_ = tsc_clock::any_cpu;
+	std::uint64_t steady_start_ = 0;
+
+	/* mtr::tsc_clock time stamp of the start when tracing, otherwise 0. */
+	std::uint64_t trace_start_ = 0;
+};
+
+using span = basic_span<default_clock>;
+
+/* The two timers a coroutine is recorded into, see register_coroutine. */
+struct coroutine_metric {
+	metric_handle active;
+	metric_handle suspended;
+};
+
+#if METRICS_HAS_COROUTINES
+/*
+ * Time a coroutine frame spends running, from resumption to suspension,
+ * and suspended, from suspension to resumption. A frame may be resumed on
+ * a different thread each time; both times are recorded in the shard of
+ * the thread that finishes it. Timing starts when start is called from the
+ * running coroutine; metrics that are not collected at that point are not
+ * recorded. Since frames migrate between threads and processors, neither
+ * thread_cpu_clock nor tsc_clock can time them.
+ */
+template <typename Clock = default_clock>
+class basic_coroutine_timing {
+	static_assert(not std::is_same_v<Clock, thread_cpu_clock> &&
+	                  not std::is_same_v<Clock, tsc_clock>,
+	              "coroutines may resume on another thread, so they need a global clock");
+
+public:
+	void start(const coroutine_metric &metric);
+	void suspend();
+	void resume();
+
+	/* Records both times, if timing was started, and stops timing. */
+	void finish();
+
+	bool is_active() const;
+
+	/* Times accumulated up to the last suspension or resumption. */
+	std::chrono::nanoseconds active_time() const;
+	std::chrono::nanoseconds suspended_time() const;
+
+private:
+	std::chrono::nanoseconds advance();
+
+	/* Only engaged while timing. */
+	std::optional<coroutine_metric> metric_;
+	std::uint64_t last_ = 0;
+	bool suspended_ = false;
+
+	std::chrono::nanoseconds active_time_{0};
+	std::chrono::nanoseconds suspended_time_{0};
+};
+
+/* Finishes the timing when it goes out of scope, i.e. when the coroutine
+ * body completes, throws, or is destroyed while suspended. */
+template <typename Clock>
+class basic_coroutine_scope {
+public:
+	explicit basic_coroutine_scope(basic_coroutine_timing<Clock> *timing);
+	basic_coroutine_scope(basic_coroutine_scope &&other) noexcept;
+	basic_coroutine_scope &operator=(basic_coroutine_scope &&other) = delete;
+	~basic_coroutine_scope();
+
+private:
+	basic_coroutine_timing<Clock> *timing_;
+};
+
+namespace detail {
+
+/* The awaiter that a co_await on `awaitable` would use. */
+template <typename Awaitable>
+decltype(auto) get_awaiter(Awaitable &&awaitable);
+
+/* Forwards to the awaiter and notes when the coroutine suspends and when
+ * it resumes. The awaiter is held by reference unless it is a temporary
+ * made by operator co_await. */
+template <typename Clock, typename Awaiter>
+class timed_awaiter {
+public:
+	timed_awaiter(Awaiter &&awaiter, basic_coroutine_timing<Clock> &timing);
+
+	bool await_ready();
+
+	template <typename Promise>
+	decltype(auto) await_suspend(std::coroutine_handle<Promise> handle);
+
+	decltype(auto) await_resume();
+
+private:
+	Awaiter awaiter_;
+	basic_coroutine_timing<Clock> &timing_;
+};
+
+} // namespace detail
+
+/*
+ * Base of promise types whose coroutines can be timed with
+ * METRICS_RECORD_COROUTINE. Its await_transform routes every co_await of
+ * the coroutine through the timing, so a promise type that defines its own
+ * await_transform cannot use it. Suspensions at co_yield and at the initial
+ * and final suspend points are not seen; the first two count as active.
+ */
+template <typename Clock = default_clock>
+class basic_timed_promise {
+public:
+	/* co_await of a coroutine_metric starts timing and returns the scope
+	 * that finishes it. */
+	auto await_transform(const coroutine_metric &metric);
+
+	template <typename Awaitable>
+	auto await_transform(Awaitable &&awaitable);
+
+	basic_coroutine_timing<Clock> &timing();
+
+private:
+	basic_coroutine_timing<Clock> timing_;
+};
+
+using coroutine_timing = basic_coroutine_timing<default_clock>;
+using timed_promise = basic_timed_promise<default_clock>;
+#endif
+
+class metric_aggregator {
+public:
+	static metric_aggregator &instance();
+
+	metric_handle register_metric(std::string_view name,
+	                              metric_storage storage = metric_storage::thread_sharded);
+
+	void update_metric(metric_handle handle, std::chrono::nanoseconds elapsed);
+	void update_metric(std::string_view name, std::chrono::nanoseconds elapsed);
+
+	/*
+	 * While the call tree is on, collectors that time their block also track
+	 * it in the calling thread's call tree: enter_block makes it the innermost block of the thread and
+	 * exit_block records its duration against the path it was entered on.
+	 * A frame that is not the innermost one, e.g. of a coroutine suspended
+	 * while another block of the thread ran, is taken off the stack all the
+	 * same. A frame that exits on another thread is not recorded, and is left
+	 * for the thread that entered it to drop. skip_block stands in for an
+	 * entry that is not timed: the blocks nested in it are timed but left
+	 * out of the tree, as their path would lack it. It is off by default, as
+	 * it takes about as long as timing the block; blocks entered before it
+	 * is switched on are not part of it.
+	 */
+	void set_call_tree(bool call_tree);
+	bool is_call_tree() const;
+	detail::block_frame enter_block(metric_handle handle);
+	detail::block_frame skip_block();
+	void exit_block(const detail::block_frame &frame, std::chrono::nanoseconds elapsed);
+
+	/*
+	 * Tracing. While it is on, every timed block is also buffered as an event
+	 * with its start and duration in a preallocated ring of the calling
+	 * thread. write_chrome_trace drains the rings into the Chrome trace
+	 * event JSON format that chrome://tracing and the Perfetto UI load.
+	 * Events that do not fit in a thread's ring before they are written out
+	 * are dropped, see trace_events_dropped.
+	 */
+	void set_tracing(bool tracing);
+	bool is_tracing() const;
+	void trace_block(metric_handle handle, std::uint64_t start, std::chrono::nanoseconds elapsed);
+	void write_chrome_trace(std::ostream &stream);
+	std::uint64_t trace_events_dropped() const;
+
+	/* Drains the rings like write_chrome_trace, into Perfetto's binary trace
+	 * format instead: a track per thread, interned block names and time
+	 * stamps as deltas. The stream should be opened in binary mode. */
+	void write_perfetto_trace(std::ostream &stream);
+
+	/*
+	 * Flight recorder. While it is on, every timed block is also kept in a
+	 * ring of the METRICS_FLIGHT_RECORDER_EVENTS most recent blocks of its
+	 * thread, overwriting the oldest. The rings are preallocated and reused,
+	 * so the recorder can stay on in production and only be written out when
+	 * something went wrong: write_flight_recording snapshots all rings into
+	 * a binary file that flight_recording::read parses. It is
+	 * async-signal-safe, and dump_flight_recording_on_signal arranges for a
+	 * signal to trigger it. Only available on POSIX systems.
+	 */
+	void set_flight_recording(bool recording);
+	bool is_flight_recording() const;
+#if METRICS_HAS_POSIX_IO
+	/* Return false if the file could not be written, or a snapshot was
+	 * already being written. */
+	bool write_flight_recording(int fd) const;
+	bool write_flight_recording(const char *path) const;
+	bool dump_flight_recording_on_signal(int signal, const char *path);
+#endif
+
+	/* The call trees of all threads merged by path. Sampled blocks only
+	 * contribute the entries that were timed. */
+	mtr::call_tree call_tree() const;
+
+	/* Counters and gauges share the registry, the runtime switches and the
+	 * dumps with timed blocks. The kind of a metric is decided by its first
+	 * registration. Increments only touch the calling thread's count of the
+	 * counter, and are ignored for metrics of other kinds. */
+	metric_handle register_counter(std::string_view name);
+	metric_handle register_gauge(std::string_view name);
+	void increment(metric_handle handle, std::int64_t delta = 1);
+	void set_gauge(metric_handle handle, double value);
+
+	/*
+	 * Value metrics record arbitrary non-negative quantities instead of
+	 * durations. They are stored in the same recordings, as fixed point with
+	 * detail::value_scale steps per unit, so percentiles, windows and rates
+	 * work alike. Query them with an arithmetic T instead of a duration, e.g.
+	 * percentile<double>(name, 0.99). Values are rounded to the nearest
+	 * 1 / detail::value_scale, so anything below 0.0005 is recorded as 0.
+	 * Negative values are recorded as 0 and values above detail::max_value
+	 * (about 9.2e15) as detail::max_value. The sum of the values of a
+	 * metric has the same bound: totals saturate there, and the averages
+	 * derived from them are then underestimated.
+	 */
+	metric_handle register_value_metric(std::string_view name, std::string_view unit = {});
+
+	/* Registers the timers "<name>.active" and "<name>.suspended" that a
+	 * coroutine's running and suspended time are recorded into. */
+	coroutine_metric register_coroutine(std::string_view name);
+
+	template <typename V>
+	void record_value(metric_handle handle, V value);
+
+	/* Current value of a counter or a gauge, or 0 if there is no such metric. */
+	std::int64_t counter(const std::string &name) const;
+	double gauge(const std::string &name) const;
+
+	/* Counts an entry of a block that is timed once every `period` entries
+	 * of the calling thread and returns whether this entry should be timed.
+	 * Entries that are not timed only bump a thread local counter. Metrics
+	 * with shared_atomic storage are always timed. */
+	bool sample_entry(metric_handle handle, std::uint32_t period);
+
+	/*
+	 * Adaptive sampling. Metrics registered with register_adaptive_metric
+	 * are sampled with a period that the overhead governor recomputes every
+	 * so often, so that the estimated cost of recording them stays within
+	 * `fraction` of the CPU time consumed by the process. The cost of a timed
+	 * and of a skipped entry is measured once, on first use. The budget is
+	 * shared out so that rarely entered metrics keep being timed on every
+	 * entry and only the hottest ones are sampled.
+	 */
+	metric_handle register_adaptive_metric(std::string_view name);
+	bool sample_adaptive_entry(metric_handle handle);
+	void set_overhead_budget(double fraction);
+	double overhead_budget() const;
+	std::uint32_t sampling_period(std::string_view name) const;
+
+	/* Recomputes the sampling periods of the adaptive metrics. It is called
+	 * periodically from the recording path; there is no background thread. */
+	void rebalance_sampling();
+
+	/* Switch collection on or off at runtime, either as a whole or for a
+	 * single metric. A metric is collected only when both are on. Blocks
+	 * that are entered while collection is off are not recorded. A metric
+	 * can be switched before it is registered, e.g. from configuration read
+	 * on startup, and keeps the kind of its first registration.
+	 * is_enabled(name) reports whether that metric is currently collected. */
+	void set_enabled(bool enabled);
+	void set_enabled(std::string_view name, bool enabled);
+	bool is_enabled() const;
+	bool is_enabled(std::string_view name) const;
+
+	std::size_t times_entered(const std::string &name) const;
+
+	template <typename T>
+	T min(const std::string &name) const;
+
+	template <typename T>
+	T max(const std::string &name) const;
+
+	template <typename T>
+	std::pair<T, T> min_max(const std::string &name) const;
+
+	template <typename T>
+	T average(const std::string &name) const;
+
+    template <typename T>
+    T total(const std::string &name) const;
+
+	/* Value at the given quantile in [0, 1], e.g. 0.99 for p99, estimated from
+	 * the metric's histogram. */
+	template <typename T>
+	T percentile(const std::string &name, double quantile) const;
+
+	/*
+	 * Statistics over the recent history of a metric: only the entries that
+	 * were timed in the `last` period are considered, up to the span of a
+	 * window_recording (60 seconds). The history is kept per interval of a
+	 * second, so the period is rounded up to whole intervals. As with rate,
+	 * the count and total of a sampled metric are scaled up by its sampling
+	 * ratio. Metrics with shared_atomic storage keep no history.
+	 */
+	std::size_t times_entered(const std::string &name, std::chrono::nanoseconds last) const;
+
+	template <typename T>
+	T min(const std::string &name, std::chrono::nanoseconds last) const;
+
+	template <typename T>
+	T max(const std::string &name, std::chrono::nanoseconds last) const;
+
+	template <typename T>
+	T average(const std::string &name, std::chrono::nanoseconds last) const;
+
+	template <typename T>
+	T total(const std::string &name, std::chrono::nanoseconds last) const;
+
+	/*
+	 * Entries per second and mean duration with weights that decay
+	 * exponentially over the past one, five or fifteen minutes, like the
+	 * load average. The rate of a sampled metric is scaled up by its
+	 * sampling ratio. Metrics with shared_atomic storage keep neither.
+	 */
+	double rate(const std::string &name, decay_horizon horizon) const;
+
+	template <typename T>
+	T decayed_average(const std::string &name, decay_horizon horizon) const;
+
+	/* The slowest calls of a metric across all threads, slowest first, at
+	 * most slowest_calls::capacity of them. Metrics with shared_atomic
+	 * storage do not keep them. */
+	std::vector<slow_call> slowest(const std::string &name) const;
+
+	/* Population variance, in squared units of T, and standard deviation
+	 * of the timed entries. */
+	template <typename T>
+	double variance(const std::string &name) const;
+
+	template <typename T>
+	T stddev(const std::string &name) const;
+
+	/* Metrics registered with a sketch additionally keep a quantile_sketch
+	 * of their durations in every thread's shard, which estimates quantiles
+	 * within the given relative accuracy however wide the range of the
+	 * durations is. Only thread_sharded metrics keep sketches. */
+	metric_handle register_sketched_metric(std::string_view name,
+	                                       double relative_accuracy = 0.01);
+	std::optional<quantile_sketch> sketch(const std::string &name) const;
+
+	/* Value at the given quantile estimated from the metric's sketch, or 0
+	 * when the metric does not keep one. */
+	template <typename T>
+	T sketch_quantile(const std::string &name, double quantile) const;
+
+    template <typename T>
+    void dump_metrics(const std::string &name, std::ostream &stream) const;
+
+    template <typename T>
+    void dump_all(std::ostream &stream) const;
+
+    /* Prints the call tree, nested blocks indented under their parents. */
+    template <typename T>
+    void dump_call_tree(std::ostream &stream) const;
+
+    /* Prints the call tree in the folded stack format of flame graph tools,
+     * one path per line, e.g. "foo;foo_loop 5355843". Paths with a weight
+     * of 0 are left out, and ';' in names is replaced by ':'. */
+    void dump_folded_stacks(std::ostream &stream,
+                            folded_weight weight = folded_weight::self_time) const;
+
+	metric_aggregator(metric_aggregator const &) = delete;
+	void operator=(metric_aggregator const &) = delete;
+
+private:
+	friend struct detail::instrumentation_cost;
+
+	/* Registers the calling thread's shard on construction and folds it
+	 * into the retired recordings when the thread exits. */
+	class thread_shard {
+	public:
+		explicit thread_shard();
+		~thread_shard();
+
+		detail::shard shard;
+	};
+
+	explicit metric_aggregator() = default;
+
+	metric_handle register_metric(std::string_view name, metric_storage storage,
+	                              metric_kind kind, std::string_view unit = {});
+
+	/* Adds a metric whose storage and kind are left to its first
+	 * registration; mutex_ must be held. */
+	detail::metric_info &add_unregistered_metric(std::string_view name);
+
+	template <typename T>
+	void dump_recording(const std::string &name, std::string_view unit,
+	                    const detail::metric_info &info, std::ostream &stream) const;
+
+	static detail::shard &local_shard();
+
+	std::optional<block_recording> snapshot(std::string_view name) const;
+
+	/* Merges the recordings of a metric across shards; mutex_ must be held. */
+	block_recording merge_shards(std::size_t id) const;
+
+	/* Merges the recording, decaying recording and slowest calls of a metric
+	 * across shards in a single pass, so that they agree with each other;
+	 * mutex_ must be held. The window and sketch are left out, as dumps do
+	 * not print them. */
+	detail::block_recordings merge_recordings(std::size_t id) const;
+
+	std::optional<interval_recording> window(std::string_view name,
+	                                         std::chrono::nanoseconds last) const;
+	std::optional<decaying_recording> decaying(std::string_view name) const;
+
+	/* Entries per timed entry of a metric, 1 if none were timed. */
+	double sampling_ratio(std::string_view name) const;
+
+	/* Calls `consume` with the trace ring of every thread, including those
+	 * of exited threads, which are then released; mutex_ must be held. */
+	template <typename Consumer>
+	void drain_traces(Consumer &&consume);
+
+	detail::flight_ring *take_flight_ring();
+
+	/* Nanoseconds since tracing started of a trace event's start. */
+	std::uint64_t trace_time(std::uint64_t start) const;
+
+	void maybe_rebalance_sampling();
+	const detail::metric_info *find_info(std::string_view name) const;
+
+	/* The recording path of collectors, into a given shard. */
+	bool sample_entry(detail::shard &shard, metric_handle handle, std::uint32_t period);
+	void update_metric(detail::shard &shard, metric_handle handle,
+	                   std::chrono::nanoseconds elapsed);
+
+	detail::instrumentation_cost measure_instrumentation_cost();
+
+private:
+	mutable std::mutex mutex_;
+
+	/* Keys view into the names in metrics_, whose elements never move, so that
+	 * looking a metric up by name does not need to allocate. */
+	std::unordered_map<std::string_view, std::size_t> ids_;
+	std::deque<detail::metric_info> metrics_;
+	bool enabled_ = true;
+
+	/* Ids of the counters, by counter index. */
+	std::vector<std::size_t> counters_;
+
+	/* Every thread records into its own shard, indexed by metric id. Queries
+	 * merge the live shards with the ones of the threads that have exited. */
+	std::vector<detail::shard *> shards_;
+	mtr::call_tree retired_tree_;
+
+	/* Tracing state. The rings of exited threads are kept until they are
+	 * written out; both are guarded by mutex_. */
+	std::atomic<bool> tracing_{false};
+	std::atomic<bool> call_tree_{false};
+	std::atomic<std::uint64_t> trace_epoch_{0};
+	std::uint32_t trace_threads_ = 0;
+	std::vector<std::unique_ptr<detail::trace_ring>> retired_traces_;
+
+	/* Flight recorder rings, published for lock free snapshots. The storage
+	 * is guarded by mutex_; rings are never released before the aggregator. */
+	std::atomic<bool> flight_recording_{false};
+	std::array<std::atomic<detail::flight_ring *>, METRICS_FLIGHT_RECORDER_THREADS> flight_rings_{};
+	std::atomic<std::size_t> flight_ring_count_{0};
+	std::vector<std::unique_ptr<detail::flight_ring>> flight_ring_storage_;
+	mutable std::atomic<std::uint64_t> flight_snapshots_{0};
+	mutable std::atomic_flag flight_snapshot_busy_ = ATOMIC_FLAG_INIT;
+
+	/* Overhead governor state, guarded by mutex_. Rebalances are spaced in
+	 * steady_clock time and serialised by rebalance_mutex_. */
+	double overhead_budget_ = 0.01;
+	std::uint64_t last_rebalance_cpu_ = process_cpu_clock::now();
+	std::atomic<std::uint64_t> next_rebalance_{0};
+	std::mutex rebalance_mutex_;
+};
+
+template <typename T>
+struct stringify_unit {
+private:
+    constexpr static auto stringify() {
+        if constexpr (std::is_same_v<T, std::chrono::nanoseconds>) {
+            return "ns";
+        } else if constexpr (std::is_same_v<T, std::chrono::microseconds>) {
+            return "us";
+        } else if constexpr (std::is_same_v<T, std::chrono::milliseconds>) {
+            return "ms";
+        } else {
+            return "s";
+        }
+    }
+
+public:
+    static constexpr auto value = stringify();
+};
+
+inline std::chrono::nanoseconds detail::saturating_add(std::chrono::nanoseconds lhs,
+                                                      std::chrono::nanoseconds rhs) {
+	constexpr auto max = std::chrono::nanoseconds::max();
+	constexpr auto min = std::chrono::nanoseconds::min();
+	if (rhs.count() > 0 && lhs > max - rhs) {
+		return max;
+	}
+	if (rhs.count() < 0 && lhs < min - rhs) {
+		return min;
+	}
+	return lhs + rhs;
+}
+
+inline std::uint64_t detail::multiply_wide(std::uint64_t lhs, std::uint64_t rhs,
+                                           std::uint64_t &high) {
+	constexpr std::uint64_t half = 0xffffffff;
+	const std::uint64_t low_low = (lhs & half) * (rhs & half);
+	const std::uint64_t high_low = (lhs >> 32) * (rhs & half);
+	const std::uint64_t low_high = (lhs & half) * (rhs >> 32);
+	const std::uint64_t high_high = (lhs >> 32) * (rhs >> 32);
+
+	const std::uint64_t middle = (low_low >> 32) + (high_low & half) + (low_high & half);
+	high = high_high + (high_low >> 32) + (low_high >> 32) + (middle >> 32);
+	return (middle << 32) | (low_low & half);
+}
+
+inline int detail::leading_zeros(std::uint64_t value) {
+#if defined(_MSC_VER) && !defined(__clang__)
+	unsigned long index = 0;
+	_BitScanReverse64(&index, value);
+	return 63 - static_cast<int>(index);
+#else
+	return __builtin_clzll(value);
+#endif
+}
+
+template <unsigned Precision>
+inline std::size_t basic_histogram<Precision>::bucket_index(std::uint64_t value) {
+	if (value < sub_bucket_count) {
+		return static_cast<std::size_t>(value);
+	}
+
+	/* The top Precision + 1 bits of the value select the bucket within its
+	 * power of two range. */
+	const unsigned shift = 63 - detail::leading_zeros(value) - Precision;
+	const std::uint64_t mantissa = value >> shift;
+	return (shift + 1) * sub_bucket_count + (mantissa - sub_bucket_count);
+}
+
+template <unsigned Precision>
+inline std::uint64_t basic_histogram<Precision>::bucket_lower_bound(std::size_t index) {
+	if (index < sub_bucket_count) {
+		return index;
+	}
+
+	const std::size_t shift = index / sub_bucket_count - 1;
+	const std::uint64_t mantissa = index % sub_bucket_count + sub_bucket_count;
+	return mantissa << shift;
+}
+
+template <unsigned Precision>
+inline std::uint64_t basic_histogram<Precision>::bucket_upper_bound(std::size_t index) {
+	if (index < sub_bucket_count) {
+		return index;
+	}
+
+	const std::size_t shift = index / sub_bucket_count - 1;
+	const std::uint64_t mantissa = index % sub_bucket_count + sub_bucket_count;
+	/* Wraps around to the maximum value for the very last bucket. */
+	return ((mantissa + 1) << shift) - 1;
+}
+
+template <unsigned Precision>
+inline void basic_histogram<Precision>::record(std::uint64_t value) {
+	++buckets_[bucket_index(value)];
+	++count_;
+}
+
+template <unsigned Precision>
+inline void basic_histogram<Precision>::add_to_bucket(std::size_t index, std::uint64_t count) {
+	buckets_[index] += count;
+	count_ += count;
+}
+
+template <unsigned Precision>
+inline void basic_histogram<Precision>::merge(const basic_histogram &other) {
+	for (std::size_t index = 0; index < bucket_count; ++index) {
+		buckets_[index] += other.buckets_[index];
+	}
+	count_ += other.count_;
+}
+
+template <unsigned Precision>
+inline std::uint64_t basic_histogram<Precision>::count() const {
+	return count_;
+}
+
+template <unsigned Precision>
+inline std::uint64_t basic_histogram<Precision>::bucket(std::size_t index) const {
+	return buckets_[index];
+}
+
+template <unsigned Precision>
+inline std::uint64_t basic_histogram<Precision>::value_at_quantile(double quantile) const {
+	if (count_ == 0) {
+		return 0;
+	}
+
+	quantile = std::clamp(quantile, 0.0, 1.0);
+	const auto rank = std::max<std::uint64_t>(
+	    1, static_cast<std::uint64_t>(std::ceil(quantile * static_cast<double>(count_))));
+
+	std::uint64_t seen = 0;
+	for (std::size_t index = 0; index < bucket_count; ++index) {
+		seen += buckets_[index];
+		if (seen >= rank) {
+			const std::uint64_t lower = bucket_lower_bound(index);
+			return lower + (bucket_upper_bound(index) - lower) / 2;
+		}
+	}
+
+	return bucket_upper_bound(bucket_count - 1);
+}
+
+inline quantile_sketch::quantile_sketch(double relative_accuracy)
+    : relative_accuracy_(relative_accuracy)
+    , gamma_((1 + relative_accuracy) / (1 - relative_accuracy))
+    , log_gamma_(std::log(gamma_)) {
+	if (not(relative_accuracy > 0 && relative_accuracy < 1)) {
+		throw std::invalid_argument("relative accuracy must be in (0, 1)");
+	}
+}
+
+inline void quantile_sketch::record(double value) {
+	if (value <= 0) {
+		++zero_count_;
+		++count_;
+		return;
+	}
+
+	add(key(value), 1);
+}
+
+inline void quantile_sketch::merge(const quantile_sketch &other) {
+	if (other.relative_accuracy_ != relative_accuracy_) {
+		throw std::invalid_argument("cannot merge sketches of different accuracy");
+	}
+
+	zero_count_ += other.zero_count_;
+	count_ += other.zero_count_;
+	if (other.count_ == other.zero_count_) {
+		return;
+	}
+
+	for (int key = other.min_key_; key <= other.max_key_; ++key) {
+		const std::uint64_t count = other.bins_[key - other.offset_];
+		if (count > 0) {
+			add(key, count);
+		}
+	}
+}
+
+inline std::uint64_t quantile_sketch::count() const {
+	return count_;
+}
+
+inline double quantile_sketch::relative_accuracy() const {
+	return relative_accuracy_;
+}
+
+inline double quantile_sketch::value_at_quantile(double quantile) const {
+	if (count_ == 0) {
+		return 0;
+	}
+
+	quantile = std::clamp(quantile, 0.0, 1.0);
+	const double rank = quantile * static_cast<double>(count_ - 1);
+
+	double seen = static_cast<double>(zero_count_);
+	if (seen > rank) {
+		return 0;
+	}
+
+	for (int key = min_key_; key <= max_key_; ++key) {
+		seen += static_cast<double>(bins_[key - offset_]);
+		if (seen > rank) {
+			return value(key);
+		}
+	}
+
+	return value(max_key_);
+}
+
+inline int quantile_sketch::key(double value) const {
+	return static_cast<int>(std::ceil(std::log(value) / log_gamma_));
+}
+
+inline double quantile_sketch::value(int key) const {
+	/* The point of the bin (gamma^(key-1), gamma^key] with the smallest
+	 * relative distance to either of its ends. */
+	return 2 * std::pow(gamma_, key) / (gamma_ + 1);
+}
+
+inline void quantile_sketch::add(int key, std::uint64_t count) {
+	constexpr int bins = static_cast<int>(max_bins);
+
+	if (count_ == zero_count_) {
+		/* Leave room on both sides of the first value. */
+		offset_ = key - bins / 2;
+		min_key_ = key;
+		max_key_ = key;
+	} else if (key < offset_) {
+		if (max_key_ - key < bins) {
+			shift_window(std::max(max_key_ + 1 - bins, key - bins / 2));
+		} else {
+			key = offset_;
+		}
+	} else if (key >= offset_ + bins) {
+		shift_window(key + 1 - bins);
+	}
+
+	bins_[key - offset_] += count;
+	count_ += count;
+	min_key_ = std::min(min_key_, key);
+	max_key_ = std::max(max_key_, key);
+}
+
+inline void quantile_sketch::shift_window(int offset) {
+	std::array<std::uint64_t, max_bins> shifted{};
+	for (int key = min_key_; key <= max_key_; ++key) {
+		const int target = std::max(key, offset);
+		shifted[target - offset] += bins_[key - offset_];
+	}
+
+	bins_ = shifted;
+	offset_ = offset;
+	min_key_ = std::max(min_key_, offset);
+	max_key_ = std::max(max_key_, offset);
+}
+
+inline void block_recording::update(std::chrono::nanoseconds elapsed) {
+	++times_entered_;
+	++times_sampled_;
+    total_ = detail::saturating_add(total_, elapsed);
+    min_ = std::min(elapsed, min_);
+    max_ = std::max(elapsed, max_);
+	histogram_.record(static_cast<std::uint64_t>(std::max<std::int64_t>(elapsed.count(), 0)));
+
+	const auto value = static_cast<double>(elapsed.count());
+	const double delta = value - mean_;
+	mean_ += delta / static_cast<double>(times_sampled_);
+	m2_ += delta * (value - mean_);
+}
+
+inline void block_recording::merge(const block_recording &other) {
+	/* Chan et al.'s pairwise combination of the running moments. */
+	if (other.times_sampled_ > 0) {
+		const auto count = static_cast<double>(times_sampled_);
+		const auto other_count = static_cast<double>(other.times_sampled_);
+		const double merged_count = count + other_count;
+		const double delta = other.mean_ - mean_;
+
+		mean_ += delta * other_count / merged_count;
+		m2_ += other.m2_ + delta * delta * count * other_count / merged_count;
+	}
+
+	times_entered_ += other.times_entered_;
+	times_sampled_ += other.times_sampled_;
+    total_ = detail::saturating_add(total_, other.total_);
+    min_ = std::min(other.min_, min_);
+    max_ = std::max(other.max_, max_);
+	histogram_.merge(other.histogram_);
+}
+
+inline std::size_t block_recording::times_entered() const {
+	return times_entered_;
+}
+
+inline void block_recording::count_unsampled(std::uint64_t entries) {
+	times_entered_ += entries;
+}
+
+inline std::size_t block_recording::times_sampled() const {
+	return times_sampled_;
+}
+
+inline std::chrono::nanoseconds block_recording::total() const {
+	if (times_sampled_ == times_entered_ || times_sampled_ == 0) {
+		return total_;
+	}
+
+	const double scale = static_cast<double>(times_entered_) / times_sampled_;
+	const double total = static_cast<double>(total_.count()) * scale;
+	if (total >= static_cast<double>(std::chrono::nanoseconds::max().count())) {
+		return std::chrono::nanoseconds::max();
+	}
+	return std::chrono::nanoseconds(static_cast<std::int64_t>(total));
+}
+
+inline std::chrono::nanoseconds block_recording::min() const {
+    return times_sampled_ > 0 ? min_ : std::chrono::nanoseconds(0);
+}
+
+inline std::chrono::nanoseconds block_recording::max() const {
+    return times_sampled_ > 0 ? max_ : std::chrono::nanoseconds(0);
+}
+
+inline std::chrono::nanoseconds block_recording::percentile(double quantile) const {
+	if (histogram_.count() == 0) {
+		return std::chrono::nanoseconds(0);
+	}
+
+	/* The extremes are known exactly. */
+	if (quantile <= 0.0) {
+		return min_;
+	}
+	if (quantile >= 1.0) {
+		return max_;
+	}
+
+	/* The bucket midpoint can lie outside of the values actually seen. */
+	const auto value = std::chrono::nanoseconds(histogram_.value_at_quantile(quantile));
+	return std::clamp(value, min_, max_);
+}
+
+inline const histogram &block_recording::distribution() const {
+	return histogram_;
+}
+
+inline double block_recording::variance() const {
+	if (times_sampled_ == 0) {
+		return 0.0;
+	}
+
+	return m2_ / static_cast<double>(times_sampled_);
+}
+
+inline std::chrono::nanoseconds block_recording::stddev() const {
+	return std::chrono::nanoseconds(std::llround(std::sqrt(variance())));
+}
+
+inline void atomic_block_recording::update(std::chrono::nanoseconds elapsed) {
+	const std::int64_t count = elapsed.count();
+	times_entered_.fetch_add(1, std::memory_order_relaxed);
+
+	/* Negative counts are sign extended into the high word. */
+	const auto addend = static_cast<std::uint64_t>(count);
+	const std::uint64_t total_low = total_low_.fetch_add(addend, std::memory_order_relaxed);
+	const std::uint64_t total_high =
+	    (count < 0 ? ~std::uint64_t(0) : 0) + (total_low + addend < total_low ? 1 : 0);
+	if (total_high != 0) {
+		total_high_.fetch_add(total_high, std::memory_order_relaxed);
+	}
+
+	std::int64_t min = min_.load(std::memory_order_relaxed);
+	while (count < min &&
+	       not min_.compare_exchange_weak(min, count, std::memory_order_relaxed)) {
+	}
+
+	std::int64_t max = max_.load(std::memory_order_relaxed);
+	while (count > max &&
+	       not max_.compare_exchange_weak(max, count, std::memory_order_relaxed)) {
+	}
+
+	const auto value = static_cast<std::uint64_t>(std::max<std::int64_t>(count, 0));
+	buckets_[histogram::bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+
+	std::uint64_t square_high = 0;
+	const std::uint64_t square_low = detail::multiply_wide(value, value, square_high);
+	const std::uint64_t low = sum_of_squares_low_.fetch_add(square_low, std::memory_order_relaxed);
+	const std::uint64_t carry = low + square_low < low ? 1 : 0;
+	if (square_high + carry > 0) {
+		sum_of_squares_high_.fetch_add(square_high + carry, std::memory_order_relaxed);
+	}
+}
+
+inline block_recording atomic_block_recording::load() const {
+	block_recording recording;
+	recording.times_entered_ = times_entered_.load(std::memory_order_relaxed);
+	recording.times_sampled_ = recording.times_entered_;
+	const auto total_high = static_cast<std::int64_t>(total_high_.load(std::memory_order_relaxed));
+	const std::uint64_t total_low = total_low_.load(std::memory_order_relaxed);
+	const auto total = static_cast<std::int64_t>(total_low);
+	if (total_high == 0 && total >= 0) {
+		recording.total_ = std::chrono::nanoseconds(total);
+	} else if (total_high == -1 && total < 0) {
+		recording.total_ = std::chrono::nanoseconds(total);
+	} else {
+		recording.total_ = total_high < 0 ? std::chrono::nanoseconds::min()
+		                                  : std::chrono::nanoseconds::max();
+	}
+	recording.min_ = std::chrono::nanoseconds(min_.load(std::memory_order_relaxed));
+	recording.max_ = std::chrono::nanoseconds(max_.load(std::memory_order_relaxed));
+	for (std::size_t bucket = 0; bucket < histogram::bucket_count; ++bucket) {
+		const std::uint64_t count = buckets_[bucket].load(std::memory_order_relaxed);
+		if (count > 0) {
+			recording.histogram_.add_to_bucket(bucket, count);
+		}
+	}
+
+	if (recording.times_sampled_ > 0) {
+		const auto count = static_cast<double>(recording.times_sampled_);
+		const double mean = static_cast<double>(recording.total_.count()) / count;
+		const double word = std::ldexp(1.0, 64);
+		const double sum_of_squares =
+		    static_cast<double>(sum_of_squares_high_.load(std::memory_order_relaxed)) * word +
+		    static_cast<double>(sum_of_squares_low_.load(std::memory_order_relaxed));
+		double m2 = sum_of_squares - count * mean * mean;
+
+		/* The words are read separately, so the high word may still miss
+		 * an update whose low word was read. M2 is never negative, so such
+		 * a deficit shows as whole multiples of 2^64. */
+		if (m2 < -word / 2) {
+			m2 += std::round(-m2 / word) * word;
+		}
+
+		recording.mean_ = mean;
+		recording.m2_ = std::max(m2, 0.0);
+	}
+	return recording;
+}
+
+inline void interval_recording::update(std::chrono::nanoseconds elapsed) {
+	++times_entered_;
+	total_ = detail::saturating_add(total_, elapsed);
+	min_ = std::min(elapsed, min_);
+	max_ = std::max(elapsed, max_);
+}
+
+inline void interval_recording::merge(const interval_recording &other) {
+	times_entered_ += other.times_entered_;
+	total_ = detail::saturating_add(total_, other.total_);
+	min_ = std::min(other.min_, min_);
+	max_ = std::max(other.max_, max_);
+}
+
+inline std::size_t interval_recording::times_entered() const {
+	return times_entered_;
+}
+
+inline std::chrono::nanoseconds interval_recording::total() const {
+	return total_;
+}
+
+inline std::chrono::nanoseconds interval_recording::min() const {
+	return times_entered_ > 0 ? min_ : std::chrono::nanoseconds(0);
+}
+
+inline std::chrono::nanoseconds interval_recording::max() const {
+	return times_entered_ > 0 ? max_ : std::chrono::nanoseconds(0);
+}
+
+inline void window_recording::update(std::chrono::nanoseconds elapsed, std::uint64_t now) {
+	const std::uint64_t index = now / interval.count();
+	auto &slot = slots_[index % interval_count];
+	if (slot.index != index) {
+		slot.index = index;
+		slot.recording = interval_recording();
+	}
+
+	slot.recording.update(elapsed);
+}
+
+inline void window_recording::merge(const window_recording &other) {
+	for (std::size_t i = 0; i < interval_count; ++i) {
+		auto &slot = slots_[i];
+		const auto &other_slot = other.slots_[i];
+		if (other_slot.index == no_interval) {
+			continue;
+		}
+
+		if (slot.index == other_slot.index) {
+			slot.recording.merge(other_slot.recording);
+		} else if (slot.index == no_interval || slot.index < other_slot.index) {
+			slot = other_slot;
+		}
+	}
+}
+
+inline interval_recording window_recording::summary(std::chrono::nanoseconds last,
+                                                    std::uint64_t now) const {
+	const std::uint64_t current = now / interval.count();
+	const auto intervals = static_cast<std::uint64_t>(
+	    std::clamp<std::int64_t>((last.count() + interval.count() - 1) / interval.count(), 1,
+	                             interval_count));
+
+	interval_recording result;
+	for (const auto &slot : slots_) {
+		if (slot.index != no_interval && slot.index <= current &&
+		    current - slot.index < intervals) {
+			result.merge(slot.recording);
+		}
+	}
+
+	return result;
+}
+
+inline void decaying_recording::update(std::chrono::nanoseconds elapsed, std::uint64_t now) {
+	decay_to(now);
+	for (std::size_t i = 0; i < horizons.size(); ++i) {
+		counts_[i] += 1.0;
+		totals_[i] += static_cast<double>(elapsed.count());
+	}
+}
+
+inline void decaying_recording::merge(const decaying_recording &other) {
+	decay_to(other.last_);
+
+	decaying_recording decayed = other;
+	decayed.decay_to(last_);
+	for (std::size_t i = 0; i < horizons.size(); ++i) {
+		counts_[i] += decayed.counts_[i];
+		totals_[i] += decayed.totals_[i];
+	}
+}
+
+inline double decaying_recording::rate(decay_horizon horizon, std::uint64_t now) const {
+	const auto i = static_cast<std::size_t>(horizon);
+	const double count = now > last_ ? counts_[i] * decay_factor(i, now - last_) : counts_[i];
+	return count / static_cast<double>(horizons[i].count());
+}
+
+inline std::chrono::nanoseconds decaying_recording::average(decay_horizon horizon) const {
+	const auto i = static_cast<std::size_t>(horizon);
+	if (counts_[i] == 0) {
+		return std::chrono::nanoseconds(0);
+	}
+
+	return std::chrono::nanoseconds(std::llround(totals_[i] / counts_[i]));
+}
+
+inline void decaying_recording::decay_to(std::uint64_t now) {
+	if (now <= last_) {
+		return;
+	}
+
+	for (std::size_t i = 0; i < horizons.size(); ++i) {
+		const double factor = decay_factor(i, now - last_);
+		counts_[i] *= factor;
+		totals_[i] *= factor;
+	}
+	last_ = now;
+}
+
+inline double decaying_recording::decay_factor(std::size_t horizon, std::uint64_t elapsed) {
+	const auto tau = std::chrono::duration_cast<std::chrono::nanoseconds>(horizons[horizon]);
+	return std::exp(-static_cast<double>(elapsed) / static_cast<double>(tau.count()));
+}
+
+namespace detail {
+
+inline thread_local std::uint64_t current_call_context = 0;
+
+inline bool slower(const slow_call &lhs, const slow_call &rhs) {
+	return lhs.elapsed > rhs.elapsed;
+}
+
+} // namespace detail
+
+inline bool slowest_calls::admits(std::chrono::nanoseconds elapsed) const {
+	return size_ < capacity || elapsed > calls_[0].elapsed;
+}
+
+inline void slowest_calls::insert(const slow_call &call) {
+	if (size_ < capacity) {
+		calls_[size_++] = call;
+		std::push_heap(calls_.begin(), calls_.begin() + size_, detail::slower);
+		return;
+	}
+
+	if (not admits(call.elapsed)) {
+		return;
+	}
+
+	std::pop_heap(calls_.begin(), calls_.end(), detail::slower);
+	calls_.back() = call;
+	std::push_heap(calls_.begin(), calls_.end(), detail::slower);
+}
+
+inline void slowest_calls::merge(const slowest_calls &other) {
+	for (std::size_t i = 0; i < other.size_; ++i) {
+		insert(other.calls_[i]);
+	}
+}
+
+inline std::vector<slow_call> slowest_calls::sorted() const {
+	std::vector<slow_call> calls(calls_.begin(), calls_.begin() + size_);
+	std::sort(calls.begin(), calls.end(), detail::slower);
+	return calls;
+}
+
+inline void set_call_context(std::uint64_t context) {
+	detail::current_call_context = context;
+}
+
+inline std::uint64_t call_context() {
+	return detail::current_call_context;
+}
+
+inline std::chrono::nanoseconds call_tree::node::self() const {
+	return std::max(inclusive - nested, std::chrono::nanoseconds(0));
+}
+
+inline call_tree::call_tree() : nodes_(1) {}
+
+inline const call_tree::node &call_tree::at(node_id id) const {
+	return nodes_[id];
+}
+
+inline std::size_t call_tree::size() const {
+	return nodes_.size();
+}
+
+inline call_tree::node_id call_tree::find_child(node_id parent, std::size_t metric) const {
+	for (const node_id child : nodes_[parent].children) {
+		if (nodes_[child].metric == metric) {
+			return child;
+		}
+	}
+
+	return root;
+}
+
+inline call_tree::node_id call_tree::add_child(node_id parent, std::size_t metric,
+                                               std::string_view name) {
+	const auto id = static_cast<node_id>(nodes_.size());
+	auto &child = nodes_.emplace_back();
+	child.name = name;
+	child.metric = metric;
+	child.parent = parent;
+	nodes_[parent].children.push_back(id);
+
+	return id;
+}
+
+inline void call_tree::record(node_id id, std::chrono::nanoseconds elapsed) {
+	auto &entered = nodes_[id];
+	++entered.times_entered;
+	entered.inclusive += elapsed;
+	if (id != root) {
+		nodes_[entered.parent].nested += elapsed;
+	}
+}
+
+inline void call_tree::merge(const call_tree &other) {
+	/* Parents come before their children, so they are always mapped first. */
+	std::vector<node_id> mapped(other.nodes_.size(), root);
+	for (node_id id = 1; id < other.nodes_.size(); ++id) {
+		const auto &theirs = other.nodes_[id];
+		const node_id parent = mapped[theirs.parent];
+
+		node_id ours = find_child(parent, theirs.metric);
+		if (ours == root) {
+			ours = add_child(parent, theirs.metric, theirs.name);
+		}
+		mapped[id] = ours;
+
+		auto &merged = nodes_[ours];
+		merged.times_entered += theirs.times_entered;
+		merged.inclusive += theirs.inclusive;
+		merged.nested += theirs.nested;
+	}
+}
+
+inline detail::trace_ring::trace_ring(std::uint32_t thread)
+    : events_(std::make_unique<trace_event[]>(capacity)), thread_(thread) {}
+
+inline void detail::trace_ring::push(const trace_event &event) {
+	const auto head = head_.load(std::memory_order_relaxed);
+	if (head - tail_.load(std::memory_order_acquire) == capacity) {
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	events_[head & (capacity - 1)] = event;
+	head_.store(head + 1, std::memory_order_release);
+}
+
+template <typename Consumer>
+inline void detail::trace_ring::drain(Consumer &&consume) {
+	const auto tail = tail_.load(std::memory_order_relaxed);
+	const auto head = head_.load(std::memory_order_acquire);
+	for (auto i = tail; i != head; ++i) {
+		consume(events_[i & (capacity - 1)]);
+	}
+
+	tail_.store(head, std::memory_order_release);
+}
+
+inline std::uint32_t detail::trace_ring::thread() const {
+	return thread_;
+}
+
+inline std::uint64_t detail::trace_ring::dropped() const {
+	return dropped_.load(std::memory_order_relaxed);
+}
+
+inline detail::flight_ring::flight_ring() : slots_(std::make_unique<slot[]>(capacity)) {}
+
+inline void detail::flight_ring::push(const record &entry) {
+	const auto head = head_.load(std::memory_order_relaxed);
+	auto &slot = slots_[head & (capacity - 1)];
+
+	/* Odd while the record is being written, see snapshot. */
+	slot.sequence.store(2 * head + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.info.store(entry.info, std::memory_order_relaxed);
+	slot.thread.store(entry.thread, std::memory_order_relaxed);
+	slot.start.store(entry.start, std::memory_order_relaxed);
+	slot.duration.store(entry.duration, std::memory_order_relaxed);
+	slot.sequence.store(2 * head + 2, std::memory_order_release);
+
+	head_.store(head + 1, std::memory_order_release);
+}
+
+template <typename Consumer>
+inline void detail::flight_ring::snapshot(Consumer &&consume) const {
+	const auto head = head_.load(std::memory_order_acquire);
+	for (auto i = head > capacity ? head - capacity : 0; i != head; ++i) {
+		const auto &slot = slots_[i & (capacity - 1)];
+		const auto sequence = slot.sequence.load(std::memory_order_acquire);
+		if (sequence != 2 * i + 2) {
+			continue;
+		}
+
+		const record copy{slot.info.load(std::memory_order_relaxed),
+		                  slot.thread.load(std::memory_order_relaxed),
+		                  slot.start.load(std::memory_order_relaxed),
+		                  slot.duration.load(std::memory_order_relaxed)};
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (slot.sequence.load(std::memory_order_relaxed) == sequence) {
+			consume(copy);
+		}
+	}
+}
+
+inline flight_recording flight_recording::read(std::istream &stream) {
+	const auto read_exactly = [&](void *data, std::size_t size) {
+		stream.read(static_cast<char *>(data), static_cast<std::streamsize>(size));
+		return static_cast<std::size_t>(stream.gcount()) == size;
+	};
+
+	const detail::flight_file_header expected{};
+	detail::flight_file_header header{};
+	if (not read_exactly(&header, sizeof(header)) ||
+	    std::memcmp(&header, &expected, sizeof(header)) != 0) {
+		throw std::runtime_error("not a flight recording");
+	}
+
+	flight_recording recording;
+	detail::flight_file_entry entry{};
+	while (read_exactly(&entry, sizeof(entry))) {
+		if (entry.tag == detail::flight_file_entry::event_tag) {
+			recording.events.push_back({entry.thread_or_length, entry.metric,
+			                            std::chrono::nanoseconds(entry.start),
+			                            std::chrono::nanoseconds(entry.duration)});
+		} else if (entry.tag == detail::flight_file_entry::name_tag) {
+			std::string name(entry.thread_or_length, '\0');
+			if (not read_exactly(name.data(), name.size())) {
+				throw std::runtime_error("truncated flight recording");
+			}
+			recording.names[entry.metric] = std::move(name);
+		} else {
+			throw std::runtime_error("corrupt flight recording");
+		}
+	}
+
+	if (stream.gcount() != 0) {
+		throw std::runtime_error("truncated flight recording");
+	}
+
+	return recording;
+}
+
+inline void detail::proto_writer::varint_field(std::uint32_t field, std::uint64_t value) {
+	varint(std::uint64_t{field} << 3 | varint_type);
+	varint(value);
+}
+
+inline void detail::proto_writer::string_field(std::uint32_t field, std::string_view value) {
+	varint(std::uint64_t{field} << 3 | length_delimited_type);
+	varint(value.size());
+	bytes_.append(value);
+}
+
+inline void detail::proto_writer::message_field(std::uint32_t field,
+                                                const proto_writer &message) {
+	string_field(field, message.bytes_);
+}
+
+inline const std::string &detail::proto_writer::bytes() const {
+	return bytes_;
+}
+
+inline void detail::proto_writer::clear() {
+	bytes_.clear();
+}
+
+inline void detail::proto_writer::varint(std::uint64_t value) {
+	/* Seven bits at a time, least significant first, with the high bit set
+	 * on all but the last byte. */
+	while (value >= 0x80) {
+		bytes_.push_back(static_cast<char>((value & 0x7f) | 0x80));
+		value >>= 7;
+	}
+	bytes_.push_back(static_cast<char>(value));
+}
+
+inline void detail::spin_lock::lock() {
+	while (locked_.exchange(true, std::memory_order_acquire)) {
+		while (locked_.load(std::memory_order_relaxed)) {
+			std::this_thread::yield();
+		}
+	}
+}
+
+inline void detail::spin_lock::unlock() {
+	locked_.store(false, std::memory_order_release);
+}
+
+inline const detail::block_recordings *detail::shard::timed(std::size_t id) const {
+	return id < slots.size() ? slots[id].timed.get() : nullptr;
+}
+
+inline void detail::block_recordings::merge(const block_recordings &other) {
+	recording.merge(other.recording);
+	window.merge(other.window);
+	decaying.merge(other.decaying);
+	slowest.merge(other.slowest);
+
+	if (other.sketch) {
+		if (sketch) {
+			sketch->merge(*other.sketch);
+		} else {
+			sketch = std::make_unique<quantile_sketch>(*other.sketch);
+		}
+	}
+}
+
+inline detail::shard_slot &detail::shard::slot(std::size_t id) {
+	if (id < slots.size()) {
+		return slots[id];
+	}
+
+	std::lock_guard<spin_lock> guard(lock);
+	while (slots.size() <= id) {
+		slots.emplace_back();
+	}
+
+	return slots[id];
+}
+
+inline bool detail::shard::unwind(call_tree::node_id node) {
+	const auto iter = std::find(stack.rbegin(), stack.rend(), node);
+	if (iter == stack.rend()) {
+		return false;
+	}
+
+	stack.erase(std::next(iter).base());
+	return true;
+}
+
+inline void detail::shard::drop_orphans() {
+	std::lock_guard<spin_lock> guard(lock);
+	for (const auto node : orphans) {
+		unwind(node);
+	}
+	orphans.clear();
+	has_orphans.store(false, std::memory_order_relaxed);
+}
+
+inline std::atomic<std::int64_t> &detail::shard::count(std::size_t index) {
+	if (index < counts.size()) {
+		return counts[index];
+	}
+
+	std::lock_guard<spin_lock> guard(lock);
+	while (counts.size() <= index) {
+		counts.emplace_back(0);
+	}
+
+	return counts[index];
+}
+
+template <typename T>
+inline T detail::quantity_cast(std::chrono::nanoseconds quantity) {
+	if constexpr (std::is_arithmetic_v<T>) {
+		return static_cast<T>(static_cast<double>(quantity.count()) / value_scale);
+	} else {
+		return std::chrono::duration_cast<T>(quantity);
+	}
+}
+
+template <typename T>
+inline double detail::nanoseconds_per_unit() {
+	if constexpr (std::is_arithmetic_v<T>) {
+		return static_cast<double>(value_scale);
+	} else {
+		return std::chrono::duration<double, std::nano>(T(1)).count();
+	}
+}
+
+template <typename T>
+inline auto detail::count_of(T quantity) {
+	if constexpr (std::is_arithmetic_v<T>) {
+		return quantity;
+	} else {
+		return quantity.count();
+	}
+}
+
+inline metric_handle::metric_handle(detail::metric_info *info) : info_(info) {}
+
+inline std::size_t metric_handle::id() const {
+	return info_->id;
+}
+
+inline bool metric_handle::is_active() const {
+	return info_->active.load(std::memory_order_relaxed);
+}
+
+inline std::uint32_t metric_handle::sampling_period() const {
+	return info_->sampling_period.load(std::memory_order_relaxed);
+}
+
+inline detail::metric_info::metric_info(std::size_t id, std::string_view name, metric_kind kind)
+    : id(id), name(name), kind(kind) {}
+
+template <typename Clock>
+inline std::uint64_t chrono_clock<Clock>::now() {
+	const auto since_epoch = Clock::now().time_since_epoch();
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(since_epoch).count();
+}
+
+template <typename Clock>
+inline std::chrono::nanoseconds chrono_clock<Clock>::to_nanoseconds(std::uint64_t ticks) {
+	return std::chrono::nanoseconds(ticks);
+}
+
+inline std::uint64_t coarse_clock::now() {
+#if METRICS_HAS_CLOCK_GETTIME && defined(CLOCK_MONOTONIC_COARSE)
+	timespec time{};
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &time);
+	return static_cast<std::uint64_t>(time.tv_sec) * 1'000'000'000 + time.tv_nsec;
+#else
+	return steady_clock::now();
+#endif
+}
+
+inline std::chrono::nanoseconds coarse_clock::to_nanoseconds(std::uint64_t ticks) {
+	return std::chrono::nanoseconds(ticks);
+}
+
+inline std::uint64_t thread_cpu_clock::now() {
+#if METRICS_HAS_CLOCK_GETTIME && defined(CLOCK_THREAD_CPUTIME_ID)
+	timespec time{};
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+	return static_cast<std::uint64_t>(time.tv_sec) * 1'000'000'000 + time.tv_nsec;
+#else
+	return steady_clock::now();
+#endif
+}
+
+inline std::chrono::nanoseconds thread_cpu_clock::to_nanoseconds(std::uint64_t ticks) {
+	return std::chrono::nanoseconds(ticks);
+}
+
+inline std::uint64_t process_cpu_clock::now() {
+#if METRICS_HAS_CLOCK_GETTIME && defined(CLOCK_PROCESS_CPUTIME_ID)
+	timespec time{};
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &time);
+	return static_cast<std::uint64_t>(time.tv_sec) * 1'000'000'000 + time.tv_nsec;
+#else
+	const auto ticks = static_cast<double>(std::clock());
+	return static_cast<std::uint64_t>(ticks * (1'000'000'000.0 / CLOCKS_PER_SEC));
+#endif
+}
+
+inline std::chrono::nanoseconds process_cpu_clock::to_nanoseconds(std::uint64_t ticks) {
+	return std::chrono::nanoseconds(ticks);
+}
+
+inline std::uint64_t virtual_clock::now() {
+	return time().load(std::memory_order_relaxed);
+}
+
+inline std::chrono::nanoseconds virtual_clock::to_nanoseconds(std::uint64_t ticks) {
+	return std::chrono::nanoseconds(ticks);
+}
+
+inline void virtual_clock::set(std::chrono::nanoseconds time_point) {
+	time().store(time_point.count(), std::memory_order_relaxed);
+}
+
+inline void virtual_clock::advance(std::chrono::nanoseconds duration) {
+	time().fetch_add(duration.count(), std::memory_order_relaxed);
+}
+
+inline std::atomic<std::uint64_t> &virtual_clock::time() {
+	static std::atomic<std::uint64_t> value{0};
+	return value;
+}
+
+inline std::uint64_t tsc_clock::now() {
+	if (calibrated().invariant) {
+		return read_tsc();
+	}
+
+	return read_steady_clock();
+}
+
+inline std::uint64_t tsc_clock::now(std::uint32_t &cpu) {
+	if (calibrated().invariant) {
+		return read_tsc(cpu);
+	}
+
+	cpu = any_cpu;
+	return read_steady_clock();
+}
+
+inline std::chrono::nanoseconds tsc_clock::to_nanoseconds(std::uint64_t ticks) {
+	const auto nanoseconds = static_cast<double>(ticks) * calibrated().nanoseconds_per_tick;
+	return std::chrono::nanoseconds(static_cast<std::int64_t>(nanoseconds));
+}
+
+inline bool tsc_clock::is_invariant() {
+	return calibrated().invariant;
+}
+
+inline const tsc_clock::calibration &tsc_clock::calibrated() {
+	static const calibration result = []() {
+		if (not detect_invariant_tsc()) {
+			return calibration{false, 1.0};
+		}
+
+		/* Spin for a few milliseconds of steady_clock time and compare how
+		 * far the counter advanced in the meantime. */
+		constexpr std::uint64_t calibration_period = 5'000'000;
+		const std::uint64_t steady_start = read_steady_clock();
+		const std::uint64_t tsc_start = read_tsc();
+
+		std::uint64_t steady_end = steady_start;
+		while (steady_end - steady_start < calibration_period) {
+			steady_end = read_steady_clock();
+		}
+		const std::uint64_t tsc_end = read_tsc();
+
+		if (tsc_end <= tsc_start) {
+			return calibration{false, 1.0};
+		}
+
+		return calibration{true, static_cast<double>(steady_end - steady_start) /
+		                             static_cast<double>(tsc_end - tsc_start)};
+	}();
+
+	return result;
+}
+
+inline bool tsc_clock::detect_invariant_tsc() {
+#if METRICS_HAS_TSC && defined(_MSC_VER)
+	int registers[4] = {};
+	__cpuid(registers, 0x80000000);
+	if (static_cast<unsigned>(registers[0]) < 0x80000007) {
+		return false;
+	}
+
+	__cpuid(registers, 0x80000001);
+	const bool has_rdtscp = registers[3] & (1 << 27);
+	__cpuid(registers, 0x80000007);
+	const bool invariant = registers[3] & (1 << 8);
+	return has_rdtscp && invariant;
+#elif METRICS_HAS_TSC
+	unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+	if (__get_cpuid_max(0x80000000, nullptr) < 0x80000007) {
+		return false;
+	}
+
+	__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx);
+	const bool has_rdtscp = edx & (1u << 27);
+	__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+	const bool invariant = edx & (1u << 8);
+	return has_rdtscp && invariant;
+#else
+	return false;
+#endif
+}
+
+inline std::uint64_t tsc_clock::read_tsc() {
+	std::uint32_t cpu = 0;
+	return read_tsc(cpu);
+}
+
+inline std::uint64_t tsc_clock::read_tsc(std::uint32_t &cpu) {
+#if METRICS_HAS_TSC
+	/* rdtscp waits for the preceding instructions to execute, so the work
+	 * before a time stamp is not counted towards the block that follows.
+	 * The operating system stores the processor number in its aux value. */
+	unsigned int aux = 0;
+	const std::uint64_t ticks = __rdtscp(&aux);
+	cpu = aux;
+	return ticks;
+#else
+	cpu = any_cpu;
+	return read_steady_clock();
+#endif
+}
+
+inline std::uint64_t tsc_clock::read_steady_clock() {
+	return steady_clock::now();
+}
+
+template <typename Clock>
+inline basic_timer<Clock>::basic_timer() : start_time_(Clock::now()) {}
+
+template <typename Clock>
+inline void basic_timer<Clock>::restart() {
+	start_time_ = Clock::now();
+}
+
+template <typename Clock>
+inline std::chrono::nanoseconds basic_timer<Clock>::elapsed() const {
+	/* Guards against counters that are not synchronised between cores. */
+	const std::uint64_t end_time = Clock::now();
+	if (end_time <= start_time_) {
+		return std::chrono::nanoseconds(0);
+	}
+
+	return Clock::to_nanoseconds(end_time - start_time_);
+}
+
+template <typename Clock>
+inline basic_collector<Clock>::basic_collector(metric_handle handle)
+    : handle_(handle), timer_() {
+	if (handle_.is_active()) {
+		start();
+	}
+}
+
+template <typename Clock>
+inline basic_collector<Clock>::basic_collector(metric_handle handle,
+                                               std::uint32_t sampling_period)
+    : handle_(handle), timer_() {
+	if (not handle_.is_active()) {
+		return;
+	}
+
+	auto &aggregator = metric_aggregator::instance();
+	if (aggregator.sample_entry(handle_, sampling_period)) {
+		start();
+	} else if (aggregator.is_call_tree()) {
+		frame_ = aggregator.skip_block();
+	}
+}
+
+template <typename Clock>
+inline basic_collector<Clock>::basic_collector(metric_handle handle, adaptive_sampling_t)
+    : handle_(handle), timer_() {
+	if (not handle_.is_active()) {
+		return;
+	}
+
+	auto &aggregator = metric_aggregator::instance();
+	if (aggregator.sample_adaptive_entry(handle_)) {
+		start();
+	} else if (aggregator.is_call_tree()) {
+		frame_ = aggregator.skip_block();
+	}
+}
+
+template <typename Clock>
+inline basic_collector<Clock>::basic_collector(std::string_view metric_name)
+    : basic_collector(metric_aggregator::instance().register_metric(metric_name)) {}
+
+template <typename Clock>
+inline basic_collector<Clock>::~basic_collector() {
+	if (not timer_) {
+		if (frame_.owner) {
+			metric_aggregator::instance().exit_block(frame_, std::chrono::nanoseconds(0));
+		}
+		return;
+	}
+
+	const std::chrono::nanoseconds elapsed = timer_->elapsed();
+	auto &aggregator = metric_aggregator::instance();
+	if (frame_.owner) {
+		aggregator.exit_block(frame_, elapsed);
+	}
+	aggregator.update_metric(handle_, elapsed);
+	if (trace_start_ != 0) {
+		aggregator.trace_block(handle_, trace_start_, elapsed);
+	}
+}
+
+template <typename Clock>
+inline void basic_collector<Clock>::start() {
+	auto &aggregator = metric_aggregator::instance();
+	if (aggregator.is_call_tree()) {
+		frame_ = aggregator.enter_block(handle_);
+	}
+	if (aggregator.is_tracing() || aggregator.is_flight_recording()) {
+		trace_start_ = tsc_clock::now();
+	}
+	timer_.emplace();
+}
+
+template <typename Clock>
+inline basic_span<Clock>::basic_span(basic_span &&other) noexcept
+    : handle_(std::exchange(other.handle_, std::nullopt)),
+      start_(other.start_),
+      cpu_(other.cpu_),
+      steady_start_(other.steady_start_),
+      trace_start_(std::exchange(other.trace_start_, 0)) {}
+
+template <typename Clock>
+inline basic_span<Clock> &basic_span<Clock>::operator=(basic_span &&other) noexcept {
+	handle_ = std::exchange(other.handle_, std::nullopt);
+	start_ = other.start_;
+	cpu_ = other.cpu_;
+	steady_start_ = other.steady_start_;
+	trace_start_ = std::exchange(other.trace_start_, 0);
+	return *this;
+}
+
+template <typename Clock>
+inline bool basic_span<Clock>::is_active() const {
+	return handle_.has_value();
+}
+
+template <typename Clock>
+inline std::chrono::nanoseconds basic_span<Clock>::elapsed() const {
+	/* As in basic_timer, time stamps that went backwards count as 0. */
+	const auto since = [](std::uint64_t start, std::uint64_t end, auto to_nanoseconds) {
+		return end > start ? to_nanoseconds(end - start) : std::chrono::nanoseconds(0);
+	};
+
+	if constexpr (per_cpu_clock) {
+		std::uint32_t cpu = tsc_clock::any_cpu;
+		const std::uint64_t end = tsc_clock::now(cpu);
+		if (cpu != cpu_) {
+			return since(steady_start_, steady_clock::now(), steady_clock::to_nanoseconds);
+		}
+		return since(start_, end, tsc_clock::to_nanoseconds);
+	} else {
+		return since(start_, Clock::now(), Clock::to_nanoseconds);
+	}
+}
+
+template <typename Clock>
+inline basic_span<Clock> start(metric_handle handle) {
+	basic_span<Clock> span;
+	if (not handle.is_active()) {
+		return span;
+	}
+
+	auto &aggregator = metric_aggregator::instance();
+	if (aggregator.is_tracing() || aggregator.is_flight_recording()) {
+		span.trace_start_ = tsc_clock::now();
+	}
+	span.handle_ = handle;
+	if constexpr (basic_span<Clock>::per_cpu_clock) {
+		span.steady_start_ = steady_clock::now();
+		span.start_ = tsc_clock::now(span.cpu_);
+	} else {
+		span.start_ = Clock::now();
+	}
+	return span;
+}
+
+template <typename Clock>
+inline std::chrono::nanoseconds stop(basic_span<Clock> &span) {
+	if (not span.handle_) {
+		return std::chrono::nanoseconds(0);
+	}
+
+	const std::chrono::nanoseconds elapsed = span.elapsed();
+	auto &aggregator = metric_aggregator::instance();
+	aggregator.update_metric(*span.handle_, elapsed);
+	if (span.trace_start_ != 0) {
+		aggregator.trace_block(*span.handle_, span.trace_start_, elapsed);
+	}
+
+	span.handle_.reset();
+	span.trace_start_ = 0;
+	return elapsed;
+}
+
+#if METRICS_HAS_COROUTINES
+template <typename Clock>
+inline void basic_coroutine_timing<Clock>::start(const coroutine_metric &metric) {
+	if (not metric.active.is_active() && not metric.suspended.is_active()) {
+		return;
+	}
+
+	metric_ = metric;
+	last_ = Clock::now();
+	suspended_ = false;
+	active_time_ = suspended_time_ = std::chrono::nanoseconds(0);
+}
+
+template <typename Clock>
+inline void basic_coroutine_timing<Clock>::suspend() {
+	if (metric_ && not suspended_) {
+		active_time_ += advance();
+		suspended_ = true;
+	}
+}
+
+template <typename Clock>
+inline void basic_coroutine_timing<Clock>::resume() {
+	if (metric_ && suspended_) {
+		suspended_time_ += advance();
+		suspended_ = false;
+	}
+}
+
+template <typename Clock>
+inline void basic_coroutine_timing<Clock>::finish() {
+	if (not metric_) {
+		return;
+	}
+
+	/* A frame destroyed while suspended was suspended until now. */
+	(suspended_ ? suspended_time_ : active_time_) += advance();
+	auto &aggregator = metric_aggregator::instance();
+	aggregator.update_metric(metric_->active, active_time_);
+	aggregator.update_metric(metric_->suspended, suspended_time_);
+	metric_.reset();
+}
+
+template <typename Clock>
+inline bool basic_coroutine_timing<Clock>::is_active() const {
+	return metric_.has_value();
+}
+
+template <typename Clock>
+inline std::chrono::nanoseconds basic_coroutine_timing<Clock>::active_time() const {
+	return active_time_;
+}
+
+template <typename Clock>
+inline std::chrono::nanoseconds basic_coroutine_timing<Clock>::suspended_time() const {
+	return suspended_time_;
+}
+
+template <typename Clock>
+inline std::chrono::nanoseconds basic_coroutine_timing<Clock>::advance() {
+	const std::uint64_t now = Clock::now();
+	const std::uint64_t last = std::exchange(last_, now);
+	return now > last ? Clock::to_nanoseconds(now - last) : std::chrono::nanoseconds(0);
+}
+
+template <typename Clock>
+inline basic_coroutine_scope<Clock>::basic_coroutine_scope(basic_coroutine_timing<Clock> *timing)
+    : timing_(timing) {}
+
+template <typename Clock>
+inline basic_coroutine_scope<Clock>::basic_coroutine_scope(basic_coroutine_scope &&other) noexcept
+    : timing_(std::exchange(other.timing_, nullptr)) {}
+
+template <typename Clock>
+inline basic_coroutine_scope<Clock>::~basic_coroutine_scope() {
+	if (timing_) {
+		timing_->finish();
+	}
+}
+
+namespace detail {
+
+template <typename Awaitable>
+inline decltype(auto) get_awaiter(Awaitable &&awaitable) {
+	if constexpr (requires { std::forward<Awaitable>(awaitable).operator co_await(); }) {
+		return std::forward<Awaitable>(awaitable).operator co_await();
+	} else if constexpr (requires { operator co_await(std::forward<Awaitable>(awaitable)); }) {
+		return operator co_await(std::forward<Awaitable>(awaitable));
+	} else {
+		return std::forward<Awaitable>(awaitable);
+	}
+}
+
+template <typename Clock, typename Awaiter>
+inline timed_awaiter<Clock, Awaiter>::timed_awaiter(Awaiter &&awaiter,
+                                                    basic_coroutine_timing<Clock> &timing)
+    : awaiter_(std::forward<Awaiter>(awaiter)), timing_(timing) {}
+
+template <typename Clock, typename Awaiter>
+inline bool timed_awaiter<Clock, Awaiter>::await_ready() {
+	return awaiter_.await_ready();
+}
+
+template <typename Clock, typename Awaiter>
+template <typename Promise>
+inline decltype(auto)
+timed_awaiter<Clock, Awaiter>::await_suspend(std::coroutine_handle<Promise> handle) {
+	/* Another thread may resume, or even destroy, the coroutine before the
+	 * awaiter returns, so the timing is not touched afterwards. If the
+	 * coroutine is not suspended after all, it resumes through
+	 * await_resume, unless the awaiter throws. */
+	timing_.suspend();
+	try {
+		return awaiter_.await_suspend(handle);
+	} catch (...) {
+		timing_.resume();
+		throw;
+	}
+}
+
+template <typename Clock, typename Awaiter>
+inline decltype(auto) timed_awaiter<Clock, Awaiter>::await_resume() {
+	timing_.resume();
+	return awaiter_.await_resume();
+}
+
+} // namespace detail
+
+template <typename Clock>
+inline auto basic_timed_promise<Clock>::await_transform(const coroutine_metric &metric) {
+	struct starter {
+		bool await_ready() const noexcept { return true; }
+		void await_suspend(std::coroutine_handle<>) const noexcept {}
+
+		basic_coroutine_scope<Clock> await_resume() const {
+			timing->start(metric);
+			return basic_coroutine_scope<Clock>(timing);
+		}
+
+		basic_coroutine_timing<Clock> *timing;
+		coroutine_metric metric;
+	};
+
+	return starter{&timing_, metric};
+}
+
+template <typename Clock>
+template <typename Awaitable>
+inline auto basic_timed_promise<Clock>::await_transform(Awaitable &&awaitable) {
+	using awaiter = decltype(detail::get_awaiter(std::forward<Awaitable>(awaitable)));
+	return detail::timed_awaiter<Clock, awaiter>(
+	    detail::get_awaiter(std::forward<Awaitable>(awaitable)), timing_);
+}
+
+template <typename Clock>
+inline basic_coroutine_timing<Clock> &basic_timed_promise<Clock>::timing() {
+	return timing_;
+}
+#endif
+
+inline metric_aggregator &metric_aggregator::instance() {
+	static metric_aggregator instance;
+	return instance;
+}
+
+inline metric_aggregator::thread_shard::thread_shard() {
+	auto &aggregator = instance();
+	std::lock_guard<std::mutex> guard(aggregator.mutex_);
+	aggregator.shards_.push_back(&shard);
+	shard.number = ++aggregator.trace_threads_;
+}
+
+inline metric_aggregator::thread_shard::~thread_shard() {
+	auto &aggregator = instance();
+	std::lock_guard<std::mutex> guard(aggregator.mutex_);
+	std::lock_guard<detail::spin_lock> shard_guard(shard.lock);
+
+	for (std::size_t id = 0; id < shard.slots.size(); ++id) {
+		const auto &slot = shard.slots[id];
+		auto &info = aggregator.metrics_[id];
+		const std::uint64_t unsampled = slot.unsampled.load(std::memory_order_relaxed);
+		if (not slot.timed && unsampled == 0) {
+			continue;
+		}
+
+		if (not info.retired) {
+			info.retired = std::make_unique<detail::block_recordings>();
+		}
+		if (slot.timed) {
+			info.retired->merge(*slot.timed);
+		}
+		info.retired->recording.count_unsampled(unsampled);
+	}
+
+	for (std::size_t index = 0; index < shard.counts.size(); ++index) {
+		aggregator.metrics_[aggregator.counters_[index]].retired_count +=
+		    shard.counts[index].load(std::memory_order_relaxed);
+	}
+
+	aggregator.retired_tree_.merge(shard.tree);
+	if (shard.trace) {
+		aggregator.retired_traces_.push_back(std::move(shard.trace));
+	}
+	if (shard.flight) {
+		shard.flight->in_use.store(false, std::memory_order_release);
+	}
+
+	auto &shards = aggregator.shards_;
+	shards.erase(std::find(shards.begin(), shards.end(), &shard));
+}
+
+inline detail::shard &metric_aggregator::local_shard() {
+	static thread_local thread_shard local;
+	return local.shard;
+}
+
+inline metric_handle metric_aggregator::register_metric(std::string_view name,
+                                                        metric_storage storage) {
+	return register_metric(name, storage, metric_kind::timer);
+}
+
+inline metric_handle metric_aggregator::register_counter(std::string_view name) {
+	return register_metric(name, metric_storage::thread_sharded, metric_kind::counter);
+}
+
+inline metric_handle metric_aggregator::register_gauge(std::string_view name) {
+	return register_metric(name, metric_storage::thread_sharded, metric_kind::gauge);
+}
+
+inline metric_handle metric_aggregator::register_value_metric(std::string_view name,
+                                                              std::string_view unit) {
+	return register_metric(name, metric_storage::thread_sharded, metric_kind::value, unit);
+}
+
+inline coroutine_metric metric_aggregator::register_coroutine(std::string_view name) {
+	const std::string prefix(name);
+	return coroutine_metric{register_metric(prefix + ".active"),
+	                        register_metric(prefix + ".suspended")};
+}
+
+inline metric_handle metric_aggregator::register_metric(std::string_view name,
+                                                        metric_storage storage,
+                                                        metric_kind kind,
+                                                        std::string_view unit) {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	/* The storage and kind of a metric are decided by its first registration. */
+	const auto iter = ids_.find(name);
+	auto &info = iter != ids_.end() ? metrics_[iter->second] : add_unregistered_metric(name);
+	if (info.registered) {
+		return metric_handle(&info);
+	}
+
+	info.registered = true;
+	info.kind = kind;
+	info.unit = unit;
+	if (kind == metric_kind::counter) {
+		info.counter_index = counters_.size();
+		counters_.push_back(info.id);
+	}
+	if (storage == metric_storage::shared_atomic) {
+		info.atomic = std::make_unique<atomic_block_recording>();
+	}
+
+	return metric_handle(&info);
+}
+
+inline detail::metric_info &metric_aggregator::add_unregistered_metric(std::string_view name) {
+	const std::size_t id = metrics_.size();
+	auto &info = metrics_.emplace_back(id, name, metric_kind::timer);
+	info.registered = false;
+	info.active.store(enabled_, std::memory_order_relaxed);
+	ids_.emplace(info.name, id);
+	return info;
+}
+
+inline void metric_aggregator::update_metric(metric_handle handle,
+                                             std::chrono::nanoseconds elapsed) {
+	if (handle.info_->atomic) {
+		handle.info_->atomic->update(elapsed);
+		return;
+	}
+
+	update_metric(local_shard(), handle, elapsed);
+}
+
+inline void metric_aggregator::update_metric(detail::shard &shard, metric_handle handle,
+                                             std::chrono::nanoseconds elapsed) {
+	auto &slot = shard.slot(handle.id());
+	const double sketch_accuracy = handle.info_->sketch_accuracy.load(std::memory_order_relaxed);
+
+	if (not slot.timed) {
+		auto timed = std::make_unique<detail::block_recordings>();
+		std::lock_guard<detail::spin_lock> guard(shard.lock);
+		slot.timed = std::move(timed);
+	}
+
+	const auto now =
+	    static_cast<std::uint64_t>(coarse_clock::to_nanoseconds(coarse_clock::now()).count());
+
+	std::lock_guard<detail::spin_lock> guard(shard.lock);
+	auto &timed = *slot.timed;
+	timed.recording.update(elapsed);
+	timed.window.update(elapsed, now);
+	timed.decaying.update(elapsed, now);
+	if (timed.slowest.admits(elapsed)) {
+		timed.slowest.insert(
+		    {elapsed, std::chrono::system_clock::now(), std::this_thread::get_id(), call_context()});
+	}
+
+	if (sketch_accuracy > 0) {
+		if (not timed.sketch) {
+			timed.sketch = std::make_unique<quantile_sketch>(sketch_accuracy);
+		}
+		timed.sketch->record(static_cast<double>(elapsed.count()));
+	}
+}
+
+inline bool metric_aggregator::sample_entry(metric_handle handle, std::uint32_t period) {
+	if (handle.info_->atomic || period <= 1) {
+		return true;
+	}
+
+	return sample_entry(local_shard(), handle, period);
+}
+
+inline bool metric_aggregator::sample_entry(detail::shard &shard, metric_handle handle,
+                                            std::uint32_t period) {
+	auto &slot = shard.slot(handle.id());
+	if (slot.countdown == 0) {
+		slot.countdown = period - 1;
+		return true;
+	}
+
+	--slot.countdown;
+	slot.unsampled.store(slot.unsampled.load(std::memory_order_relaxed) + 1,
+	                     std::memory_order_relaxed);
+	return false;
+}
+
+inline void metric_aggregator::update_metric(std::string_view name, std::chrono::nanoseconds elapsed) {
+	update_metric(register_metric(name), elapsed);
+}
+
+inline detail::block_frame metric_aggregator::enter_block(metric_handle handle) {
+	auto &shard = local_shard();
+	if (shard.has_orphans.load(std::memory_order_acquire)) {
+		shard.drop_orphans();
+	}
+
+	const auto parent = shard.stack.empty() ? call_tree::root : shard.stack.back();
+	if (parent == detail::block_frame::untimed) {
+		shard.stack.push_back(parent);
+		return {&shard, shard.number, parent};
+	}
+
+	/* Only the owner adds nodes, so looking one up needs no lock. */
+	auto node = shard.tree.find_child(parent, handle.id());
+	if (node == call_tree::root) {
+		std::lock_guard<detail::spin_lock> guard(shard.lock);
+		node = shard.tree.add_child(parent, handle.id(), handle.info_->name);
+	}
+
+	shard.stack.push_back(node);
+	return {&shard, shard.number, node};
+}
+
+inline detail::block_frame metric_aggregator::skip_block() {
+	auto &shard = local_shard();
+	shard.stack.push_back(detail::block_frame::untimed);
+	return {&shard, shard.number, detail::block_frame::untimed};
+}
+
+inline void metric_aggregator::exit_block(const detail::block_frame &frame,
+                                          std::chrono::nanoseconds elapsed) {
+	auto &shard = local_shard();
+	if (frame.owner != &shard || frame.owner_number != shard.number) {
+		/* The owner may have exited, in which case its stack went with it,
+		 * and its address may since have been taken by another shard. */
+		std::lock_guard<std::mutex> guard(mutex_);
+		if (std::find(shards_.begin(), shards_.end(), frame.owner) != shards_.end() &&
+		    frame.owner->number == frame.owner_number) {
+			std::lock_guard<detail::spin_lock> owner_guard(frame.owner->lock);
+			frame.owner->orphans.push_back(frame.node);
+			frame.owner->has_orphans.store(true, std::memory_order_release);
+		}
+		return;
+	}
+
+	if (not shard.stack.empty() && shard.stack.back() == frame.node) {
+		shard.stack.pop_back();
+	} else if (not shard.unwind(frame.node)) {
+		return;
+	}
+
+	if (frame.node == detail::block_frame::untimed) {
+		return;
+	}
+
+	std::lock_guard<detail::spin_lock> guard(shard.lock);
+	shard.tree.record(frame.node, elapsed);
+}
+
+inline void metric_aggregator::set_call_tree(bool call_tree) {
+	call_tree_.store(call_tree, std::memory_order_relaxed);
+}
+
+inline bool metric_aggregator::is_call_tree() const {
+	return call_tree_.load(std::memory_order_relaxed);
+}
+
+inline void metric_aggregator::set_tracing(bool tracing) {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	/* Time stamps are written relative to when tracing was first started. */
+	if (tracing && trace_epoch_.load(std::memory_order_relaxed) == 0) {
+		trace_epoch_.store(tsc_clock::now(), std::memory_order_relaxed);
+	}
+	tracing_.store(tracing, std::memory_order_relaxed);
+}
+
+inline bool metric_aggregator::is_tracing() const {
+	return tracing_.load(std::memory_order_relaxed);
+}
+
+inline void metric_aggregator::trace_block(metric_handle handle, std::uint64_t start,
+                                           std::chrono::nanoseconds elapsed) {
+	auto &shard = local_shard();
+	const auto duration = static_cast<std::uint64_t>(elapsed.count());
+
+	if (is_tracing()) {
+		if (not shard.trace) {
+			std::lock_guard<std::mutex> guard(mutex_);
+			shard.trace = std::make_unique<detail::trace_ring>(shard.number);
+		}
+		shard.trace->push({start, duration, handle.id()});
+	}
+
+	if (is_flight_recording()) {
+		if (not shard.flight_taken) {
+			shard.flight = take_flight_ring();
+			shard.flight_taken = true;
+		}
+		if (shard.flight) {
+			shard.flight->push({handle.info_, shard.number, start, duration});
+		}
+	}
+}
+
+inline detail::flight_ring *metric_aggregator::take_flight_ring() {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	const auto count = flight_ring_count_.load(std::memory_order_relaxed);
+	for (std::size_t i = 0; i < count; ++i) {
+		auto *ring = flight_rings_[i].load(std::memory_order_relaxed);
+		if (not ring->in_use.load(std::memory_order_acquire)) {
+			ring->in_use.store(true, std::memory_order_relaxed);
+			return ring;
+		}
+	}
+
+	if (count == flight_rings_.size()) {
+		return nullptr;
+	}
+
+	auto *ring = flight_ring_storage_.emplace_back(std::make_unique<detail::flight_ring>()).get();
+	flight_rings_[count].store(ring, std::memory_order_release);
+	flight_ring_count_.store(count + 1, std::memory_order_release);
+	return ring;
+}
+
+inline void metric_aggregator::set_flight_recording(bool recording) {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	if (recording && trace_epoch_.load(std::memory_order_relaxed) == 0) {
+		trace_epoch_.store(tsc_clock::now(), std::memory_order_relaxed);
+	}
+	flight_recording_.store(recording, std::memory_order_relaxed);
+}
+
+inline bool metric_aggregator::is_flight_recording() const {
+	return flight_recording_.load(std::memory_order_relaxed);
+}
+
+#if METRICS_HAS_POSIX_IO
+inline bool metric_aggregator::write_flight_recording(int fd) const {
+	if (flight_snapshot_busy_.test_and_set(std::memory_order_acquire)) {
+		return false;
+	}
+
+	/* Entries are buffered on the stack and written with write(2) only, so
+	 * that nothing here allocates or takes a lock. */
+	char buffer[4096];
+	std::size_t size = 0;
+	bool ok = true;
+	const auto flush = [&]() {
+		for (std::size_t written = 0; ok && written < size;) {
+			const auto result = ::write(fd, buffer + written, size - written);
+			if (result < 0 && errno == EINTR) {
+				continue;
+			}
+			ok = result > 0;
+			written += ok ? static_cast<std::size_t>(result) : 0;
+		}
+		size = 0;
+	};
+	const auto append = [&](const void *data, std::size_t length) {
+		const auto *bytes = static_cast<const char *>(data);
+		while (length > 0) {
+			if (size == sizeof(buffer)) {
+				flush();
+			}
+			const auto chunk = std::min(length, sizeof(buffer) - size);
+			std::memcpy(buffer + size, bytes, chunk);
+			size += chunk;
+			bytes += chunk;
+			length -= chunk;
+		}
+	};
+
+	const detail::flight_file_header header{};
+	append(&header, sizeof(header));
+
+	const auto snapshot = flight_snapshots_.fetch_add(1, std::memory_order_relaxed) + 1;
+	const auto epoch = trace_epoch_.load(std::memory_order_relaxed);
+	const auto count = flight_ring_count_.load(std::memory_order_acquire);
+	for (std::size_t i = 0; i < count; ++i) {
+		flight_rings_[i].load(std::memory_order_acquire)->snapshot(
+		    [&](const detail::flight_ring::record &record) {
+			    const auto &info = *record.info;
+			    if (info.flight_snapshot.exchange(snapshot, std::memory_order_relaxed) != snapshot) {
+				    const detail::flight_file_entry name{detail::flight_file_entry::name_tag,
+				                                         static_cast<std::uint32_t>(info.name.size()),
+				                                         info.id, 0, 0};
+				    append(&name, sizeof(name));
+				    append(info.name.data(), info.name.size());
+			    }
+
+			    const auto ticks = record.start > epoch ? record.start - epoch : 0;
+			    const detail::flight_file_entry event{
+			        detail::flight_file_entry::event_tag, record.thread, info.id,
+			        static_cast<std::uint64_t>(tsc_clock::to_nanoseconds(ticks).count()),
+			        record.duration};
+			    append(&event, sizeof(event));
+		    });
+	}
+	flush();
+
+	flight_snapshot_busy_.clear(std::memory_order_release);
+	return ok;
+}
+
+inline bool metric_aggregator::write_flight_recording(const char *path) const {
+	const int fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return false;
+	}
+
+	const bool ok = write_flight_recording(fd);
+	return ::close(fd) == 0 && ok;
+}
+
+inline void detail::flight_recording_signal_handler(int) {
+	const int saved_errno = errno;
+	metric_aggregator::instance().write_flight_recording(flight_recording_path);
+	errno = saved_errno;
+}
+
+inline bool metric_aggregator::dump_flight_recording_on_signal(int signal, const char *path) {
+	const auto length = std::strlen(path);
+	if (length >= sizeof(detail::flight_recording_path)) {
+		return false;
+	}
+	std::memcpy(detail::flight_recording_path, path, length + 1);
+
+	struct sigaction action {};
+	action.sa_handler = detail::flight_recording_signal_handler;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	return ::sigaction(signal, &action, nullptr) == 0;
+}
+#endif
+
+inline void metric_aggregator::write_chrome_trace(std::ostream &stream) {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	const auto write_name = [&](std::string_view name) {
+		for (const char c : name) {
+			if (c == '"' || c == '\\') {
+				stream << '\\' << c;
+			} else if (static_cast<unsigned char>(c) < 0x20) {
+				stream << ' ';
+			} else {
+				stream << c;
+			}
+		}
+	};
+
+	/* Microseconds with three decimals, without touching the stream's flags. */
+	const auto write_microseconds = [&](std::uint64_t nanoseconds) {
+		stream << nanoseconds / 1000 << '.' << nanoseconds / 100 % 10 << nanoseconds / 10 % 10
+		       << nanoseconds % 10;
+	};
+
+	bool first = true;
+	stream << R"({"traceEvents":[)";
+	drain_traces([&](detail::trace_ring &ring) {
+		ring.drain([&](const detail::trace_event &event) {
+			stream << (first ? "\n" : ",\n") << R"({"name":")";
+			write_name(metrics_[event.metric].name);
+			stream << R"(","ph":"X","pid":1,"tid":)" << ring.thread() << R"(,"ts":)";
+			write_microseconds(trace_time(event.start));
+			stream << R"(,"dur":)";
+			write_microseconds(event.duration);
+			stream << "}";
+			first = false;
+		});
+	});
+	stream << "\n]," << R"("displayTimeUnit":"ns"})" << std::endl;
+}
+
+template <typename Consumer>
+inline void metric_aggregator::drain_traces(Consumer &&consume) {
+	for (auto &ring : retired_traces_) {
+		consume(*ring);
+	}
+	retired_traces_.clear();
+
+	/* Rings are only created and retired under mutex_, so they can be read
+	 * without the shard's lock. */
+	for (auto *shard : shards_) {
+		if (shard->trace) {
+			consume(*shard->trace);
+		}
+	}
+}
+
+inline std::uint64_t metric_aggregator::trace_time(std::uint64_t start) const {
+	const auto epoch = trace_epoch_.load(std::memory_order_relaxed);
+	const auto ticks = start > epoch ? start - epoch : 0;
+	return static_cast<std::uint64_t>(tsc_clock::to_nanoseconds(ticks).count());
+}
+
+inline void metric_aggregator::write_perfetto_trace(std::ostream &stream) {
+	/* Field numbers of perfetto/trace/trace_packet.proto and the messages it
+	 * refers to. */
+	enum : std::uint32_t {
+		trace_packet = 1,
+
+		packet_clock_snapshot = 6,
+		packet_timestamp = 8,
+		packet_sequence_id = 10,
+		packet_track_event = 11,
+		packet_interned_data = 12,
+		packet_sequence_flags = 13,
+		packet_defaults = 59,
+		packet_track_descriptor = 60,
+
+		clock_snapshot_clocks = 1,
+		clock_id = 1,
+		clock_timestamp = 2,
+		clock_is_incremental = 3,
+
+		defaults_timestamp_clock_id = 58,
+		defaults_track_event = 11,
+		track_event_defaults_track_uuid = 11,
+
+		track_uuid = 1,
+		track_name = 2,
+		track_thread = 4,
+		thread_pid = 1,
+		thread_tid = 2,
+		thread_name = 5,
+
+		track_event_type = 9,
+		track_event_name_iid = 10,
+		interned_event_names = 2,
+		event_name_iid = 1,
+		event_name_name = 2,
+	};
+
+	enum : std::uint64_t {
+		builtin_clock_boottime = 6,
+		/* Sequence scoped clock whose time stamps are deltas to the previous
+		 * packet's, which keeps them to a byte or two. */
+		incremental_clock = 64,
+
+		incremental_state_cleared = 1,
+		needs_incremental_state = 2,
+
+		slice_begin = 1,
+		slice_end = 2,
+	};
+
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	detail::proto_writer packet;
+	detail::proto_writer nested;
+	detail::proto_writer inner;
+	detail::proto_writer trace;
+	const auto write_packet = [&]() {
+		trace.clear();
+		trace.message_field(trace_packet, packet);
+		stream.write(trace.bytes().data(), static_cast<std::streamsize>(trace.bytes().size()));
+		packet.clear();
+	};
+
+	std::vector<detail::trace_event> events;
+	std::vector<std::uint64_t> open_ends;
+	std::vector<bool> interned;
+
+	drain_traces([&](detail::trace_ring &ring) {
+		events.clear();
+		ring.drain([&](const detail::trace_event &event) { events.push_back(event); });
+		if (events.empty()) {
+			return;
+		}
+
+		/* Outer blocks first, so that the slices can be opened and closed in
+		 * order with a stack; the ring holds them in the order they ended. */
+		std::sort(events.begin(), events.end(),
+		          [](const detail::trace_event &lhs, const detail::trace_event &rhs) {
+			          return lhs.start != rhs.start ? lhs.start < rhs.start
+			                                        : lhs.duration > rhs.duration;
+		          });
+
+		const std::uint64_t sequence = ring.thread();
+		const std::uint64_t uuid = ring.thread();
+		std::uint64_t last = trace_time(events.front().start);
+
+		/* Start the sequence: its incremental clock, defaults and track. */
+		packet.varint_field(packet_sequence_id, sequence);
+		packet.varint_field(packet_sequence_flags, incremental_state_cleared);
+		nested.clear();
+		for (const auto &[id, incremental] : {std::pair{incremental_clock, true},
+		                                     std::pair{builtin_clock_boottime, false}}) {
+			inner.clear();
+			inner.varint_field(clock_id, id);
+			inner.varint_field(clock_timestamp, last);
+			if (incremental) {
+				inner.varint_field(clock_is_incremental, 1);
+			}
+			nested.message_field(clock_snapshot_clocks, inner);
+		}
+		packet.message_field(packet_clock_snapshot, nested);
+		nested.clear();
+		inner.clear();
+		inner.varint_field(track_event_defaults_track_uuid, uuid);
+		nested.varint_field(defaults_timestamp_clock_id, incremental_clock);
+		nested.message_field(defaults_track_event, inner);
+		packet.message_field(packet_defaults, nested);
+		write_packet();
+
+		const std::string name = "thread " + std::to_string(ring.thread());
+		packet.varint_field(packet_sequence_id, sequence);
+		nested.clear();
+		inner.clear();
+		inner.varint_field(thread_pid, 1);
+		inner.varint_field(thread_tid, ring.thread());
+		inner.string_field(thread_name, name);
+		nested.varint_field(track_uuid, uuid);
+		nested.string_field(track_name, name);
+		nested.message_field(track_thread, inner);
+		packet.message_field(packet_track_descriptor, nested);
+		write_packet();
+
+		const auto write_event = [&](std::uint64_t time, std::uint64_t type, std::size_t metric) {
+			/* Clamped, as durations are measured with the collector's clock. */
+			time = std::max(time, last);
+			packet.varint_field(packet_sequence_id, sequence);
+			packet.varint_field(packet_sequence_flags, needs_incremental_state);
+			packet.varint_field(packet_timestamp, time - last);
+			last = time;
+
+			nested.clear();
+			nested.varint_field(track_event_type, type);
+			if (type == slice_begin) {
+				nested.varint_field(track_event_name_iid, metric + 1);
+			}
+			packet.message_field(packet_track_event, nested);
+
+			if (type == slice_begin && not interned[metric]) {
+				interned[metric] = true;
+				inner.clear();
+				inner.varint_field(event_name_iid, metric + 1);
+				inner.string_field(event_name_name, metrics_[metric].name);
+				nested.clear();
+				nested.message_field(interned_event_names, inner);
+				packet.message_field(packet_interned_data, nested);
+			}
+			write_packet();
+		};
+
+		interned.assign(metrics_.size(), false);
+		open_ends.clear();
+		for (const auto &event : events) {
+			const auto start = trace_time(event.start);
+			while (not open_ends.empty() && open_ends.back() <= start) {
+				write_event(open_ends.back(), slice_end, 0);
+				open_ends.pop_back();
+			}
+
+			write_event(start, slice_begin, event.metric);
+			open_ends.push_back(std::max(start + event.duration, last));
+		}
+		while (not open_ends.empty()) {
+			write_event(open_ends.back(), slice_end, 0);
+			open_ends.pop_back();
+		}
+	});
+
+	stream.flush();
+}
+
+inline std::uint64_t metric_aggregator::trace_events_dropped() const {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	std::uint64_t dropped = 0;
+	for (const auto &ring : retired_traces_) {
+		dropped += ring->dropped();
+	}
+	for (auto *shard : shards_) {
+		if (shard->trace) {
+			dropped += shard->trace->dropped();
+		}
+	}
+
+	return dropped;
+}
+
+inline mtr::call_tree metric_aggregator::call_tree() const {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	mtr::call_tree tree = retired_tree_;
+	for (auto *shard : shards_) {
+		std::lock_guard<detail::spin_lock> shard_guard(shard->lock);
+		tree.merge(shard->tree);
+	}
+
+	return tree;
+}
+
+inline void metric_aggregator::increment(metric_handle handle, std::int64_t delta) {
+	if (not handle.is_active() || handle.info_->kind != metric_kind::counter) {
+		return;
+	}
+
+	auto &count = local_shard().count(handle.info_->counter_index);
+	count.store(count.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+template <typename V>
+inline void metric_aggregator::record_value(metric_handle handle, V value) {
+	static_assert(std::is_arithmetic_v<V>, "values must be integral or floating point");
+
+	if (not handle.is_active()) {
+		return;
+	}
+
+	constexpr std::int64_t max_fixed = detail::max_value * detail::value_scale;
+
+	std::int64_t fixed = 0;
+	if constexpr (std::is_floating_point_v<V>) {
+		/* Compared after scaling, where the bound is exact enough for llround
+		 * not to overflow. NaN fails both comparisons. */
+		const double scaled = static_cast<double>(value) * detail::value_scale;
+		if (scaled >= static_cast<double>(max_fixed)) {
+			fixed = max_fixed;
+		} else if (scaled > 0) {
+			fixed = std::llround(scaled);
+		}
+	} else if (value > 0) {
+		fixed = static_cast<std::uint64_t>(value) >= static_cast<std::uint64_t>(detail::max_value)
+		            ? max_fixed
+		            : static_cast<std::int64_t>(value) * detail::value_scale;
+	}
+
+	update_metric(handle, std::chrono::nanoseconds(fixed));
+}
+
+inline void metric_aggregator::set_gauge(metric_handle handle, double value) {
+	if (not handle.is_active()) {
+		return;
+	}
+
+	handle.info_->gauge.store(value, std::memory_order_relaxed);
+}
+
+inline std::int64_t metric_aggregator::counter(const std::string &name) const {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	const auto iter = ids_.find(name);
+	if (iter == ids_.end()) {
+		return 0;
+	}
+
+	const auto &info = metrics_[iter->second];
+	if (info.kind != metric_kind::counter) {
+		return 0;
+	}
+
+	std::int64_t count = info.retired_count;
+	for (auto *shard : shards_) {
+		std::lock_guard<detail::spin_lock> shard_guard(shard->lock);
+		if (info.counter_index < shard->counts.size()) {
+			count += shard->counts[info.counter_index].load(std::memory_order_relaxed);
+		}
+	}
+
+	return count;
+}
+
+inline double metric_aggregator::gauge(const std::string &name) const {
+	const auto info = find_info(name);
+	if (!info) {
+		return 0.0;
+	}
+
+	return info->gauge.load(std::memory_order_relaxed);
+}
+
+inline const detail::instrumentation_cost &detail::instrumentation_cost::measured() {
+	static const instrumentation_cost cost =
+	    metric_aggregator::instance().measure_instrumentation_cost();
+
+	return cost;
+}
+
+inline metric_handle metric_aggregator::register_adaptive_metric(std::string_view name) {
+	const auto handle = register_metric(name);
+
+	std::lock_guard<std::mutex> guard(mutex_);
+	handle.info_->adaptive.store(true, std::memory_order_relaxed);
+	return handle;
+}
+
+inline metric_handle metric_aggregator::register_sketched_metric(std::string_view name,
+                                                                 double relative_accuracy) {
+	/* Validates the accuracy before the metric starts using it. */
+	(void) quantile_sketch(relative_accuracy);
+
+	const auto handle = register_metric(name);
+
+	std::lock_guard<std::mutex> guard(mutex_);
+	double expected = 0.0;
+	handle.info_->sketch_accuracy.compare_exchange_strong(expected, relative_accuracy,
+	                                                      std::memory_order_relaxed);
+	return handle;
+}
+
+inline std::optional<quantile_sketch> metric_aggregator::sketch(const std::string &name) const {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	const auto iter = ids_.find(name);
+	if (iter == ids_.end()) {
+		return std::nullopt;
+	}
+
+	const std::size_t id = iter->second;
+	const double accuracy = metrics_[id].sketch_accuracy.load(std::memory_order_relaxed);
+	if (accuracy == 0.0) {
+		return std::nullopt;
+	}
+
+	quantile_sketch sketch(accuracy);
+	const auto &retired = metrics_[id].retired;
+	if (retired && retired->sketch) {
+		sketch.merge(*retired->sketch);
+	}
+
+	for (auto *shard : shards_) {
+		std::lock_guard<detail::spin_lock> shard_guard(shard->lock);
+		const auto *timed = shard->timed(id);
+		if (timed && timed->sketch) {
+			sketch.merge(*timed->sketch);
+		}
+	}
+
+	return sketch;
+}
+
+inline bool metric_aggregator::sample_adaptive_entry(metric_handle handle) {
+	/* Only look at the clock once every so many entries. */
+	constexpr std::uint32_t check_interval = 4096;
+	if (++local_shard().adaptive_entries % check_interval == 0) {
+		maybe_rebalance_sampling();
+	}
+
+	return sample_entry(handle, handle.sampling_period());
+}
+
+inline detail::instrumentation_cost metric_aggregator::measure_instrumentation_cost() {
+	constexpr int iterations = 10000;
+	constexpr auto never = std::numeric_limits<std::uint32_t>::max();
+
+	/* A scratch metric and shard that no query reads, so that measuring
+	 * leaves nothing behind. The call tree, tracing and flight recording
+	 * are left out, as they are off unless someone is looking. */
+	detail::metric_info info(0, "mtr.calibration", metric_kind::timer);
+	const metric_handle handle(&info);
+	detail::shard scratch;
+
+	const std::uint64_t timed_start = steady_clock::now();
+	for (int i = 0; i < iterations; ++i) {
+		if (handle.is_active()) {
+			basic_timer<default_clock> timer;
+			update_metric(scratch, handle, timer.elapsed());
+		}
+	}
+	const std::uint64_t timed_end = steady_clock::now();
+
+	for (int i = 0; i < iterations; ++i) {
+		if (handle.is_active()) {
+			sample_entry(scratch, handle, never);
+		}
+	}
+	const std::uint64_t skipped_end = steady_clock::now();
 
-	void restart();
-    std::chrono::nanoseconds elapsed() const;
+	return detail::instrumentation_cost{
+	    static_cast<double>(timed_end - timed_start) / iterations,
+	    static_cast<double>(skipped_end - timed_end) / iterations};
+}
 
-private:
-	static std::chrono::high_resolution_clock::time_point take_time_stamp();
+inline void metric_aggregator::set_overhead_budget(double fraction) {
+	std::lock_guard<std::mutex> guard(mutex_);
+	overhead_budget_ = fraction;
+}
 
-private:
-	std::chrono::high_resolution_clock::time_point start_time_;
-};
+inline double metric_aggregator::overhead_budget() const {
+	std::lock_guard<std::mutex> guard(mutex_);
+	return overhead_budget_;
+}
 
-class collector {
-public:
-	explicit collector(std::string metric_name);
-	~collector();
+inline std::uint32_t metric_aggregator::sampling_period(std::string_view name) const {
+	const auto info = find_info(name);
+	if (info == nullptr) {
+		return 1;
+	}
 
-private:
-	std::string _metric_name;
-	high_resolution_timer timer_;
-};
+	return info->sampling_period.load(std::memory_order_relaxed);
+}
 
-class metric_aggregator {
-public:
-	static metric_aggregator &instance();
+inline void metric_aggregator::maybe_rebalance_sampling() {
+	constexpr std::uint64_t rebalance_interval = 100'000'000;
 
-	void update_metric(const std::string &name, std::chrono::nanoseconds elapsed);
+	const std::uint64_t now = steady_clock::now();
+	if (now < next_rebalance_.load(std::memory_order_relaxed)) {
+		return;
+	}
 
-	std::size_t times_entered(const std::string &name) const;
+	std::unique_lock<std::mutex> lock(rebalance_mutex_, std::try_to_lock);
+	if (not lock || now < next_rebalance_.load(std::memory_order_relaxed)) {
+		return;
+	}
 
-	template <typename T>
-	T min(const std::string &name) const;
+	next_rebalance_.store(now + rebalance_interval, std::memory_order_relaxed);
+	rebalance_sampling();
+}
 
-	template <typename T>
-	T max(const std::string &name) const;
+inline void metric_aggregator::rebalance_sampling() {
+	constexpr std::uint32_t max_sampling_period = 1u << 20;
 
-	template <typename T>
-	std::pair<T, T> min_max(const std::string &name) const;
+	const auto &cost = detail::instrumentation_cost::measured();
 
-	template <typename T>
-	T average(const std::string &name) const;
+	std::lock_guard<std::mutex> guard(mutex_);
 
-    template <typename T>
-    T total(const std::string &name) const;
+	const std::uint64_t cpu = process_cpu_clock::now();
+	const double cpu_elapsed = static_cast<double>(cpu - last_rebalance_cpu_);
+	last_rebalance_cpu_ = cpu;
 
-    template <typename T>
-    void dump_metrics(const std::string &name, std::ostream &stream) const;
+	/* Entries of each adaptive metric since the previous rebalance. */
+	std::vector<std::pair<double, detail::metric_info *>> entries;
+	double total_entries = 0;
+	for (auto &info : metrics_) {
+		if (not info.adaptive.load(std::memory_order_relaxed) || info.atomic) {
+			continue;
+		}
 
-    template <typename T>
-    void dump_all(std::ostream &stream) const;
+		const std::uint64_t entered = merge_shards(info.id).times_entered();
+		const auto delta = static_cast<double>(entered - info.governed_entries);
+		info.governed_entries = entered;
 
-	metric_aggregator(metric_aggregator const &) = delete;
-	void operator=(metric_aggregator const &) = delete;
+		entries.emplace_back(delta, &info);
+		total_entries += delta;
+	}
 
-private:
-	explicit metric_aggregator() = default;
+	/* Every entry costs at least a skipped entry; what is left of the budget
+	 * pays for the extra cost of the timed ones. */
+	const double budget = overhead_budget_ * cpu_elapsed -
+	                      total_entries * cost.skipped_nanoseconds;
+	const double extra_cost =
+	    std::max(cost.timed_nanoseconds - cost.skipped_nanoseconds, 1.0);
+	double remaining = std::max(budget, 0.0) / extra_cost;
 
-private:
-	std::unordered_map<std::string, block_recording> metrics_;
-};
+	/* Water-fill the timed entries: metrics entered less often than their
+	 * fair share are timed every time and leave the rest to the others. */
+	std::sort(entries.begin(), entries.end(),
+	          [](const auto &lhs, const auto &rhs) { return lhs.first < rhs.first; });
 
-template <typename T>
-struct stringify_unit {
-private:
-    constexpr static auto stringify() {
-        if constexpr (std::is_same_v<T, std::chrono::nanoseconds>) {
-            return "ns";
-        } else if constexpr (std::is_same_v<T, std::chrono::microseconds>) {
-            return "us";
-        } else if constexpr (std::is_same_v<T, std::chrono::milliseconds>) {
-            return "ms";
-        } else {
-            return "s";
-        }
-    }
+	std::size_t left = entries.size();
+	for (const auto &[delta, info] : entries) {
+		const double share = remaining / left--;
 
-public:
-    static constexpr auto value = stringify();
-};
+		double period = 1;
+		if (delta > share) {
+			period = share >= 1 ? std::ceil(delta / share) : max_sampling_period;
+		}
+		period = std::min<double>(period, max_sampling_period);
 
-inline void block_recording::update(std::chrono::nanoseconds elapsed) {
-	++times_entered_;
-    total_ += elapsed;
-    min_ = std::min(elapsed, min_);
-    max_ = std::max(elapsed, max_);
+		remaining = std::max(remaining - delta / period, 0.0);
+		info->sampling_period.store(static_cast<std::uint32_t>(period),
+		                            std::memory_order_relaxed);
+	}
 }
 
-inline std::size_t block_recording::times_entered() const {
-	return times_entered_;
-}
+inline const detail::metric_info *metric_aggregator::find_info(std::string_view name) const {
+	std::lock_guard<std::mutex> guard(mutex_);
 
-inline std::chrono::nanoseconds block_recording::total() const {
-    return total_;
-}
+	const auto iter = ids_.find(name);
+	if (iter == ids_.end()) {
+		return nullptr;
+	}
 
-inline std::chrono::nanoseconds block_recording::min() const {
-    return times_entered_ > 0 ? min_ : std::chrono::nanoseconds(0);
+	return &metrics_[iter->second];
 }
 
-inline std::chrono::nanoseconds block_recording::max() const {
-    return times_entered_ > 0 ? max_ : std::chrono::nanoseconds(0);
+inline void metric_aggregator::set_enabled(bool enabled) {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	enabled_ = enabled;
+	for (auto &info : metrics_) {
+		info.active.store(enabled_ && info.enabled.load(std::memory_order_relaxed),
+		                  std::memory_order_relaxed);
+	}
 }
 
-inline high_resolution_timer::high_resolution_timer()
-    : start_time_(take_time_stamp()) {}
+inline void metric_aggregator::set_enabled(std::string_view name, bool enabled) {
+	std::lock_guard<std::mutex> guard(mutex_);
 
-inline void high_resolution_timer::restart() {
-	start_time_ = take_time_stamp();
+	/* Switching a metric before its first registration leaves its kind open. */
+	const auto iter = ids_.find(name);
+	auto &info = iter != ids_.end() ? metrics_[iter->second] : add_unregistered_metric(name);
+	info.enabled.store(enabled, std::memory_order_relaxed);
+	info.active.store(enabled_ && enabled, std::memory_order_relaxed);
 }
 
-inline std::chrono::nanoseconds high_resolution_timer::elapsed() const {
-	return std::chrono::duration_cast<std::chrono::nanoseconds>(take_time_stamp() - start_time_);
+inline bool metric_aggregator::is_enabled() const {
+	std::lock_guard<std::mutex> guard(mutex_);
+	return enabled_;
 }
 
-inline std::chrono::high_resolution_clock::time_point high_resolution_timer::take_time_stamp() {
-	return std::chrono::high_resolution_clock::now();
+inline bool metric_aggregator::is_enabled(std::string_view name) const {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	const auto iter = ids_.find(name);
+	if (iter == ids_.end()) {
+		return enabled_;
+	}
+
+	return metrics_[iter->second].active.load(std::memory_order_relaxed);
 }
 
-inline collector::collector(std::string metric_name)
-    : _metric_name(std::move(metric_name)), timer_() {}
+inline std::optional<block_recording> metric_aggregator::snapshot(std::string_view name) const {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	const auto iter = ids_.find(name);
+	if (iter == ids_.end()) {
+		return std::nullopt;
+	}
 
-inline collector::~collector() {
-	const std::chrono::nanoseconds elapsed = timer_.elapsed();
-	metric_aggregator::instance().update_metric(_metric_name, elapsed);
+	return merge_shards(iter->second);
 }
 
-inline metric_aggregator &metric_aggregator::instance() {
-	static metric_aggregator instance;
-	return instance;
+inline detail::block_recordings metric_aggregator::merge_recordings(std::size_t id) const {
+	detail::block_recordings merged;
+	if (metrics_[id].atomic) {
+		merged.recording = metrics_[id].atomic->load();
+		return merged;
+	}
+
+	const auto merge = [&merged](const detail::block_recordings &other) {
+		merged.recording.merge(other.recording);
+		merged.decaying.merge(other.decaying);
+		merged.slowest.merge(other.slowest);
+	};
+
+	if (metrics_[id].retired) {
+		merge(*metrics_[id].retired);
+	}
+
+	for (auto *shard : shards_) {
+		std::lock_guard<detail::spin_lock> shard_guard(shard->lock);
+		if (const auto *timed = shard->timed(id)) {
+			merge(*timed);
+		}
+		if (id < shard->slots.size()) {
+			merged.recording.count_unsampled(
+			    shard->slots[id].unsampled.load(std::memory_order_relaxed));
+		}
+	}
+
+	return merged;
 }
 
-inline void metric_aggregator::update_metric(const std::string &name, std::chrono::nanoseconds elapsed) {
-	const auto iter = metrics_.find(name);
-	if (iter != metrics_.end()) {
-		iter->second.update(elapsed);
-	} else {
-		block_recording new_recording;
-		new_recording.update(elapsed);
+inline block_recording metric_aggregator::merge_shards(std::size_t id) const {
+	if (metrics_[id].atomic) {
+		return metrics_[id].atomic->load();
+	}
+
+	block_recording recording;
+	if (metrics_[id].retired) {
+		recording.merge(metrics_[id].retired->recording);
+	}
 
-		metrics_.emplace(name, new_recording);
+	for (auto *shard : shards_) {
+		std::lock_guard<detail::spin_lock> shard_guard(shard->lock);
+		if (const auto *timed = shard->timed(id)) {
+			recording.merge(timed->recording);
+		}
+		if (id < shard->slots.size()) {
+			recording.count_unsampled(
+			    shard->slots[id].unsampled.load(std::memory_order_relaxed));
+		}
 	}
+
+	return recording;
 }
 
 inline std::size_t metric_aggregator::times_entered(const std::string &name) const {
-	const auto iter = metrics_.find(name);
-	if (iter == metrics_.end()) {
+	const auto recording = snapshot(name);
+	if (!recording) {
 		return 0;
 	}
 
-	return iter->second.times_entered();
+	return recording->times_entered();
 }
 
 template <typename T>
 inline T metric_aggregator::min(const std::string &name) const {
-	const auto iter = metrics_.find(name);
-	if (iter == metrics_.end()) {
+	const auto recording = snapshot(name);
+	if (!recording) {
 		return T{0};
 	}
 
-	return std::chrono::duration_cast<T>(iter->second.min());
+	return detail::quantity_cast<T>(recording->min());
 }
 
 template <typename T>
 inline T metric_aggregator::max(const std::string &name) const {
-	const auto iter = metrics_.find(name);
-	if (iter == metrics_.end()) {
+	const auto recording = snapshot(name);
+	if (!recording) {
 		return T{0};
 	}
 
-	return std::chrono::duration_cast<T>(iter->second.max());
+	return detail::quantity_cast<T>(recording->max());
 }
 
 template <typename T>
@@ -223,32 +4150,266 @@ inline std::pair<T, T> metric_aggregator::min_max(const std::string &name) const
 
 template <typename T>
 inline T metric_aggregator::average(const std::string &name) const {
-	const auto iter = metrics_.find(name);
-	if (iter == metrics_.end()) {
+	const auto recording = snapshot(name);
+	if (!recording || recording->times_entered() == 0) {
 		return T{0};
 	}
 
-	const auto nanoseconds = iter->second.total();
-    return std::chrono::duration_cast<T>(nanoseconds) / iter->second.times_entered();
+	const auto nanoseconds = recording->total();
+    return detail::quantity_cast<T>(nanoseconds) / recording->times_entered();
 }
 
 template <typename T>
 inline T metric_aggregator::total(const std::string &name) const {
-	const auto iter = metrics_.find(name);
-	if (iter == metrics_.end()) {
+	const auto recording = snapshot(name);
+	if (!recording) {
+		return T{0};
+	}
+
+    return detail::quantity_cast<T>(recording->total());
+}
+
+template <typename T>
+inline T metric_aggregator::percentile(const std::string &name, double quantile) const {
+	const auto recording = snapshot(name);
+	if (!recording) {
+		return T{0};
+	}
+
+	return detail::quantity_cast<T>(recording->percentile(quantile));
+}
+
+inline std::optional<interval_recording> metric_aggregator::window(
+    std::string_view name, std::chrono::nanoseconds last) const {
+	const auto now =
+	    static_cast<std::uint64_t>(coarse_clock::to_nanoseconds(coarse_clock::now()).count());
+
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	const auto iter = ids_.find(name);
+	if (iter == ids_.end()) {
+		return std::nullopt;
+	}
+
+	const std::size_t id = iter->second;
+	window_recording window;
+	if (metrics_[id].retired) {
+		window.merge(metrics_[id].retired->window);
+	}
+
+	for (auto *shard : shards_) {
+		std::lock_guard<detail::spin_lock> shard_guard(shard->lock);
+		if (const auto *timed = shard->timed(id)) {
+			window.merge(timed->window);
+		}
+	}
+
+	return window.summary(last, now);
+}
+
+inline std::vector<slow_call> metric_aggregator::slowest(const std::string &name) const {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	const auto iter = ids_.find(name);
+	if (iter == ids_.end()) {
+		return {};
+	}
+
+	const std::size_t id = iter->second;
+	slowest_calls slowest;
+	if (metrics_[id].retired) {
+		slowest.merge(metrics_[id].retired->slowest);
+	}
+
+	for (auto *shard : shards_) {
+		std::lock_guard<detail::spin_lock> shard_guard(shard->lock);
+		if (const auto *timed = shard->timed(id)) {
+			slowest.merge(timed->slowest);
+		}
+	}
+
+	return slowest.sorted();
+}
+
+inline std::size_t metric_aggregator::times_entered(const std::string &name,
+                                                    std::chrono::nanoseconds last) const {
+	const auto recording = window(name, last);
+	if (!recording) {
+		return 0;
+	}
+
+	return static_cast<std::size_t>(
+	    std::llround(static_cast<double>(recording->times_entered()) * sampling_ratio(name)));
+}
+
+template <typename T>
+inline T metric_aggregator::min(const std::string &name, std::chrono::nanoseconds last) const {
+	const auto recording = window(name, last);
+	if (!recording) {
+		return T{0};
+	}
+
+	return detail::quantity_cast<T>(recording->min());
+}
+
+template <typename T>
+inline T metric_aggregator::max(const std::string &name, std::chrono::nanoseconds last) const {
+	const auto recording = window(name, last);
+	if (!recording) {
+		return T{0};
+	}
+
+	return detail::quantity_cast<T>(recording->max());
+}
+
+template <typename T>
+inline T metric_aggregator::average(const std::string &name,
+                                    std::chrono::nanoseconds last) const {
+	const auto recording = window(name, last);
+	if (!recording || recording->times_entered() == 0) {
+		return T{0};
+	}
+
+	return detail::quantity_cast<T>(recording->total()) / recording->times_entered();
+}
+
+template <typename T>
+inline T metric_aggregator::total(const std::string &name, std::chrono::nanoseconds last) const {
+	const auto recording = window(name, last);
+	if (!recording) {
+		return T{0};
+	}
+
+	const double total = static_cast<double>(recording->total().count()) * sampling_ratio(name);
+	if (total >= static_cast<double>(std::chrono::nanoseconds::max().count())) {
+		return detail::quantity_cast<T>(std::chrono::nanoseconds::max());
+	}
+	return detail::quantity_cast<T>(std::chrono::nanoseconds(std::llround(total)));
+}
+
+inline std::optional<decaying_recording> metric_aggregator::decaying(
+    std::string_view name) const {
+	std::lock_guard<std::mutex> guard(mutex_);
+
+	const auto iter = ids_.find(name);
+	if (iter == ids_.end()) {
+		return std::nullopt;
+	}
+
+	const std::size_t id = iter->second;
+	decaying_recording decaying;
+	if (metrics_[id].retired) {
+		decaying.merge(metrics_[id].retired->decaying);
+	}
+
+	for (auto *shard : shards_) {
+		std::lock_guard<detail::spin_lock> shard_guard(shard->lock);
+		if (const auto *timed = shard->timed(id)) {
+			decaying.merge(timed->decaying);
+		}
+	}
+
+	return decaying;
+}
+
+inline double metric_aggregator::rate(const std::string &name, decay_horizon horizon) const {
+	const auto now =
+	    static_cast<std::uint64_t>(coarse_clock::to_nanoseconds(coarse_clock::now()).count());
+	const auto recording = decaying(name);
+	if (!recording) {
+		return 0.0;
+	}
+
+	/* Entries that were not timed are not recorded at all, so extrapolate. */
+	return recording->rate(horizon, now) * sampling_ratio(name);
+}
+
+inline double metric_aggregator::sampling_ratio(std::string_view name) const {
+	const auto totals = snapshot(name);
+	if (!totals || totals->times_sampled() == 0) {
+		return 1.0;
+	}
+
+	return static_cast<double>(totals->times_entered()) /
+	       static_cast<double>(totals->times_sampled());
+}
+
+template <typename T>
+inline T metric_aggregator::decayed_average(const std::string &name,
+                                            decay_horizon horizon) const {
+	const auto recording = decaying(name);
+	if (!recording) {
+		return T{0};
+	}
+
+	return detail::quantity_cast<T>(recording->average(horizon));
+}
+
+template <typename T>
+inline double metric_aggregator::variance(const std::string &name) const {
+	const auto recording = snapshot(name);
+	if (!recording) {
+		return 0.0;
+	}
+
+	const double scale = detail::nanoseconds_per_unit<T>();
+	return recording->variance() / (scale * scale);
+}
+
+template <typename T>
+inline T metric_aggregator::stddev(const std::string &name) const {
+	const auto recording = snapshot(name);
+	if (!recording) {
+		return T{0};
+	}
+
+	return detail::quantity_cast<T>(recording->stddev());
+}
+
+template <typename T>
+inline T metric_aggregator::sketch_quantile(const std::string &name, double quantile) const {
+	const auto merged = sketch(name);
+	if (!merged) {
 		return T{0};
 	}
 
-    return std::chrono::duration_cast<T>(iter->second.total());
+	const auto nanoseconds = std::llround(merged->value_at_quantile(quantile));
+	return detail::quantity_cast<T>(std::chrono::nanoseconds(nanoseconds));
 }
 
 template <typename T>
 void metric_aggregator::dump_metrics(const std::string &name, std::ostream &stream) const {
-	const auto iter = metrics_.find(name);
-	if (iter == metrics_.end()) {
+	const auto info = find_info(name);
+	if (!info) {
+		return;
+	}
+
+	/* The first registration may still set them, under the mutex. */
+	metric_kind kind;
+	std::string unit;
+	{
+		std::lock_guard<std::mutex> guard(mutex_);
+		kind = info->kind;
+		unit = info->unit;
+	}
+
+	if (kind == metric_kind::counter) {
+		stream << name << " metrics:" << std::endl;
+		stream << "\t" << "Count: " << counter(name) << std::endl;
+		return;
+	}
+
+	if (kind == metric_kind::gauge) {
+		stream << name << " metrics:" << std::endl;
+		stream << "\t" << "Value: " << gauge(name) << std::endl;
+		return;
+	}
+
+	if (kind == metric_kind::value) {
+		dump_recording<double>(name, unit, *info, stream);
 		return;
 	}
-    
+
     /* If the duration provided is 'larger' than the std::chrono::seconds,
      * default to std::chrono::seconds. */
     if (not std::is_same_v<T, std::common_type_t<T, std::chrono::seconds>>) {
@@ -256,22 +4417,190 @@ void metric_aggregator::dump_metrics(const std::string &name, std::ostream &stre
         return;
     }
 
-    constexpr auto unit = stringify_unit<T>::value;
+    dump_recording<T>(name, stringify_unit<T>::value, *info, stream);
+}
+
+template <typename T>
+void metric_aggregator::dump_recording(const std::string &name, std::string_view unit,
+                                       const detail::metric_info &info,
+                                       std::ostream &stream) const {
+    using detail::count_of;
+    using detail::quantity_cast;
+
+    /* Every line is printed from one snapshot, merged once, so that they
+     * agree with each other even while the metric is being recorded. */
+    const auto now =
+        static_cast<std::uint64_t>(coarse_clock::to_nanoseconds(coarse_clock::now()).count());
+    detail::block_recordings merged;
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        merged = merge_recordings(info.id);
+    }
+
+    const auto &recording = merged.recording;
+    const std::size_t entered = recording.times_entered();
+    const T total = quantity_cast<T>(recording.total());
+    T average{0};
+    if (entered > 0) {
+        average = total / entered;
+    }
+
+    /* Entries that were not timed are not recorded at all, so extrapolate. */
+    const double sampling_ratio =
+        recording.times_sampled() > 0
+            ? static_cast<double>(entered) / static_cast<double>(recording.times_sampled())
+            : 1.0;
 
     stream << name << " metrics:" << std::endl;
-    stream << "\t" << "Entered: " << times_entered(name) << std::endl;
-    stream << "\t" << "Total: " << total<T>(name).count() << unit << std::endl;
-    stream << "\t" << "Average: " << average<T>(name).count() << unit << std::endl;
-    stream << "\t" << "Min: " << min<T>(name).count() << unit << std::endl;
-    stream << "\t" << "Max: " << max<T>(name).count() << unit << std::endl;
+    stream << "\t" << "Entered: " << entered << std::endl;
+    stream << "\t" << "Total: " << count_of(total) << unit << std::endl;
+    stream << "\t" << "Average: " << count_of(average) << unit << std::endl;
+    stream << "\t" << "Min: " << count_of(quantity_cast<T>(recording.min())) << unit << std::endl;
+    stream << "\t" << "Max: " << count_of(quantity_cast<T>(recording.max())) << unit << std::endl;
+    stream << "\t" << "Stddev: " << count_of(quantity_cast<T>(recording.stddev())) << unit
+           << std::endl;
+
+    constexpr std::array<std::pair<const char *, double>, 4> percentiles = {
+        {{"P50", 0.5}, {"P90", 0.9}, {"P99", 0.99}, {"P99.9", 0.999}}};
+    for (const auto &[label, quantile] : percentiles) {
+        stream << "\t" << label << ": "
+               << count_of(quantity_cast<T>(recording.percentile(quantile))) << unit << std::endl;
+    }
+
+    const auto for_each_horizon = [&](const auto &print) {
+        for (const auto horizon : {decay_horizon::one_minute, decay_horizon::five_minutes,
+                                   decay_horizon::fifteen_minutes}) {
+            stream << " ";
+            print(horizon);
+        }
+        stream << std::endl;
+    };
+
+    stream << "\t" << "Rate 1m/5m/15m:";
+    for_each_horizon([&](decay_horizon horizon) {
+        stream << merged.decaying.rate(horizon, now) * sampling_ratio << "/s";
+    });
+    stream << "\t" << "Decayed average 1m/5m/15m:";
+    for_each_horizon([&](decay_horizon horizon) {
+        stream << count_of(quantity_cast<T>(merged.decaying.average(horizon))) << unit;
+    });
+
+    const auto calls = merged.slowest.sorted();
+    if (not calls.empty()) {
+        stream << "\t" << "Slowest:" << std::endl;
+    }
+    for (const auto &call : calls) {
+        const auto since_epoch = std::chrono::duration_cast<std::chrono::milliseconds>(
+            call.timestamp.time_since_epoch());
+        stream << "\t\t" << count_of(detail::quantity_cast<T>(call.elapsed)) << unit
+               << " at " << since_epoch.count() << "ms since epoch, thread " << call.thread
+               << ", context " << call.context << std::endl;
+    }
+
+    if (info.adaptive.load(std::memory_order_relaxed)) {
+        stream << "\t" << "Sampling period: "
+               << info.sampling_period.load(std::memory_order_relaxed) << std::endl;
+    }
 }
 
 template <typename T>
 void metric_aggregator::dump_all(std::ostream &stream) const {
-    for (const auto pair : metrics_) {
-        dump_metrics<T>(pair.first, stream);
+    std::vector<std::string_view> names;
+    {
+        std::lock_guard<std::mutex> guard(mutex_);
+        for (const auto &info : metrics_) {
+            names.push_back(info.name);
+        }
+    }
+
+    for (const auto name : names) {
+        dump_metrics<T>(std::string(name), stream);
         stream << std::endl;
     }
+
+    if (is_call_tree()) {
+        dump_call_tree<T>(stream);
+    }
+}
+
+inline void metric_aggregator::dump_folded_stacks(std::ostream &stream,
+                                                  folded_weight weight) const {
+    const auto tree = call_tree();
+
+    /* Depth first, keeping the path to the current node so that it can be
+     * written out name by name rather than built up as a string. */
+    std::vector<call_tree::node_id> path;
+    std::vector<std::pair<call_tree::node_id, std::size_t>> pending;
+    for (const auto child : tree.at(call_tree::root).children) {
+        pending.emplace_back(child, 0);
+    }
+
+    while (not pending.empty()) {
+        const auto [id, depth] = pending.back();
+        pending.pop_back();
+
+        path.resize(depth);
+        path.push_back(id);
+
+        const auto &node = tree.at(id);
+        const auto value = weight == folded_weight::self_time
+                               ? static_cast<std::uint64_t>(node.self().count())
+                               : node.times_entered;
+        if (value > 0) {
+            for (std::size_t i = 0; i < path.size(); ++i) {
+                if (i > 0) {
+                    stream << ';';
+                }
+                for (const char c : tree.at(path[i]).name) {
+                    stream << (c == ';' ? ':' : c);
+                }
+            }
+            stream << ' ' << value << '\n';
+        }
+
+        for (const auto child : node.children) {
+            pending.emplace_back(child, depth + 1);
+        }
+    }
+
+    stream.flush();
+}
+
+template <typename T>
+void metric_aggregator::dump_call_tree(std::ostream &stream) const {
+    /* See dump_metrics. */
+    if (not std::is_same_v<T, std::common_type_t<T, std::chrono::seconds>>) {
+        dump_call_tree<std::chrono::seconds>(stream);
+        return;
+    }
+
+    constexpr auto unit = stringify_unit<T>::value;
+    const auto tree = call_tree();
+
+    stream << "Call tree:" << std::endl;
+
+    /* Depth first, without recursion; children are pushed in reverse so
+     * that they are printed in the order they were first entered. */
+    std::vector<std::pair<call_tree::node_id, std::size_t>> pending;
+    const auto push_children = [&](call_tree::node_id id, std::size_t depth) {
+        const auto &children = tree.at(id).children;
+        for (auto child = children.rbegin(); child != children.rend(); ++child) {
+            pending.emplace_back(*child, depth);
+        }
+    };
+
+    push_children(call_tree::root, 1);
+    while (not pending.empty()) {
+        const auto [id, depth] = pending.back();
+        pending.pop_back();
+
+        const auto &node = tree.at(id);
+        stream << std::string(depth, '\t') << node.name << ": " << node.times_entered
+               << " entered, " << std::chrono::duration_cast<T>(node.inclusive).count() << unit
+               << " inclusive, " << std::chrono::duration_cast<T>(node.self()).count() << unit
+               << " self" << std::endl;
+        push_children(id, depth + 1);
+    }
 }
 
 } // namespace mtr
@@ -21,3 +21,117 @@ TEST(block_recording, update_test) {
     EXPECT_THAT(block.min(), std::chrono::nanoseconds(10));
     EXPECT_THAT(block.max(), std::chrono::nanoseconds(30));
 }
+
+TEST(block_recording, merge_test) {
+    mtr::block_recording lhs;
+    lhs.update(std::chrono::nanoseconds(10));
+    lhs.update(std::chrono::nanoseconds(20));
+
+    mtr::block_recording rhs;
+    rhs.update(std::chrono::nanoseconds(5));
+
+    mtr::block_recording empty;
+    lhs.merge(rhs);
+    lhs.merge(empty);
+
+    EXPECT_THAT(lhs.times_entered(), 3);
+    EXPECT_THAT(lhs.total(), std::chrono::nanoseconds(35));
+    EXPECT_THAT(lhs.min(), std::chrono::nanoseconds(5));
+    EXPECT_THAT(lhs.max(), std::chrono::nanoseconds(20));
+}
+
+TEST(atomic_block_recording, update_test) {
+    mtr::atomic_block_recording block;
+    block.update(std::chrono::nanoseconds(20));
+    block.update(std::chrono::nanoseconds(10));
+    block.update(std::chrono::nanoseconds(30));
+
+    const auto recording = block.load();
+    EXPECT_THAT(recording.times_entered(), 3);
+    EXPECT_THAT(recording.total(), std::chrono::nanoseconds(60));
+    EXPECT_THAT(recording.min(), std::chrono::nanoseconds(10));
+    EXPECT_THAT(recording.max(), std::chrono::nanoseconds(30));
+
+    EXPECT_THAT(mtr::atomic_block_recording().load().min(), std::chrono::nanoseconds(0));
+}
+
+TEST(block_recording, count_unsampled_test) {
+    mtr::block_recording block;
+    block.count_unsampled(3);
+    EXPECT_THAT(block.times_entered(), 3);
+    EXPECT_THAT(block.times_sampled(), 0);
+    EXPECT_THAT(block.total(), std::chrono::nanoseconds(0));
+    EXPECT_THAT(block.min(), std::chrono::nanoseconds(0));
+
+    block.update(std::chrono::nanoseconds(10));
+    block.update(std::chrono::nanoseconds(30));
+    block.count_unsampled(2);
+
+    EXPECT_THAT(block.times_entered(), 7);
+    EXPECT_THAT(block.times_sampled(), 2);
+    EXPECT_THAT(block.total(), std::chrono::nanoseconds(140));
+    EXPECT_THAT(block.min(), std::chrono::nanoseconds(10));
+    EXPECT_THAT(block.max(), std::chrono::nanoseconds(30));
+}
+
+TEST(block_recording, variance_test) {
+    mtr::block_recording block;
+    EXPECT_THAT(block.variance(), 0.0);
+
+    for (const int value : {2, 4, 4, 4, 5, 5, 7, 9}) {
+        block.update(std::chrono::nanoseconds(value));
+    }
+    EXPECT_DOUBLE_EQ(block.variance(), 4.0);
+    EXPECT_THAT(block.stddev(), std::chrono::nanoseconds(2));
+
+    /* Merging the halves gives the same moments as recording everything. */
+    mtr::block_recording lhs;
+    mtr::block_recording rhs;
+    for (const int value : {2, 4, 4, 4}) {
+        lhs.update(std::chrono::nanoseconds(value));
+    }
+    for (const int value : {5, 5, 7, 9}) {
+        rhs.update(std::chrono::nanoseconds(value));
+    }
+    lhs.merge(rhs);
+    EXPECT_DOUBLE_EQ(lhs.variance(), 4.0);
+
+    mtr::atomic_block_recording atomic;
+    for (const int value : {2, 4, 4, 4, 5, 5, 7, 9}) {
+        atomic.update(std::chrono::nanoseconds(value));
+    }
+    EXPECT_DOUBLE_EQ(atomic.load().variance(), 4.0);
+
+    /* Squares of durations above 2^32ns carry into the high word. */
+    mtr::atomic_block_recording wide;
+    for (const std::int64_t seconds : {2, 4, 4, 4, 5, 5, 7, 9}) {
+        wide.update(std::chrono::seconds(seconds));
+    }
+    EXPECT_NEAR(wide.load().variance(), 4e18, 4e18 * 1e-9);
+}
+
+TEST(block_recording, saturated_total_test) {
+    const auto large = std::chrono::nanoseconds::max() / 3 + std::chrono::nanoseconds(1);
+
+    /* Totals saturate instead of wrapping around, in every recording. */
+    mtr::block_recording block;
+    mtr::atomic_block_recording atomic;
+    mtr::interval_recording interval;
+    for (int i = 0; i < 3; ++i) {
+        block.update(large);
+        atomic.update(large);
+        interval.update(large);
+    }
+    EXPECT_THAT(block.total(), std::chrono::nanoseconds::max());
+    EXPECT_THAT(atomic.load().total(), std::chrono::nanoseconds::max());
+    EXPECT_THAT(interval.total(), std::chrono::nanoseconds::max());
+
+    block.merge(block);
+    EXPECT_THAT(block.total(), std::chrono::nanoseconds::max());
+
+    /* The atomic total comes back once negative durations cancel it out. */
+    for (int i = 0; i < 3; ++i) {
+        atomic.update(-large);
+    }
+    EXPECT_THAT(atomic.load().total(), std::chrono::nanoseconds(0));
+}
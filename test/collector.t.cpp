@@ -0,0 +1,182 @@
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <sstream>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "mtr/metrics.hpp"
+
+using namespace ::testing;
+
+namespace {
+
+std::atomic<std::size_t> allocations{0};
+
+} // namespace
+
+/* Count every allocation made by the test binary so that the hot path of the
+ * collector can be checked for heap usage. */
+void *operator new(std::size_t size) {
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	if (void *ptr = std::malloc(size == 0 ? 1 : size)) {
+		return ptr;
+	}
+
+	throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept {
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept {
+	std::free(ptr);
+}
+
+TEST(collector, macro_no_allocation_test) {
+	const auto record = []() {
+		METRICS_RECORD_BLOCK("storage.compaction.merge_level");
+	};
+
+	record();
+
+	const auto before = allocations.load();
+	for (int i = 0; i < 100; ++i) {
+		record();
+	}
+	EXPECT_EQ(allocations.load(), before);
+
+	const auto &aggregator = mtr::metric_aggregator::instance();
+	EXPECT_EQ(aggregator.times_entered("storage.compaction.merge_level"), 101u);
+}
+
+TEST(collector, name_no_allocation_test) {
+	const auto record = []() {
+		mtr::collector collector("storage.compaction.flush_level");
+	};
+
+	record();
+
+	const auto before = allocations.load();
+	record();
+	EXPECT_EQ(allocations.load(), before);
+
+	const auto &aggregator = mtr::metric_aggregator::instance();
+	EXPECT_EQ(aggregator.times_entered("storage.compaction.flush_level"), 2u);
+}
+
+TEST(collector, value_no_allocation_test) {
+	const auto record = [](std::size_t bytes) {
+		METRICS_RECORD_VALUE("storage.compaction.bytes_written", bytes);
+	};
+
+	record(4096);
+
+	const auto before = allocations.load();
+	for (std::size_t i = 0; i < 100; ++i) {
+		record(i);
+	}
+	EXPECT_EQ(allocations.load(), before);
+
+	const auto &aggregator = mtr::metric_aggregator::instance();
+	EXPECT_EQ(aggregator.times_entered("storage.compaction.bytes_written"), 101u);
+}
+
+TEST(collector, runtime_toggle_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto record = []() {
+		METRICS_RECORD_BLOCK("toggled_metric");
+	};
+
+	record();
+	EXPECT_EQ(aggregator.times_entered("toggled_metric"), 1u);
+
+	aggregator.set_enabled(false);
+	EXPECT_FALSE(aggregator.is_enabled());
+	EXPECT_FALSE(aggregator.is_enabled("toggled_metric"));
+	record();
+	EXPECT_EQ(aggregator.times_entered("toggled_metric"), 1u);
+
+	aggregator.set_enabled(true);
+	aggregator.set_enabled("toggled_metric", false);
+	EXPECT_TRUE(aggregator.is_enabled());
+	EXPECT_FALSE(aggregator.is_enabled("toggled_metric"));
+	record();
+	EXPECT_EQ(aggregator.times_entered("toggled_metric"), 1u);
+
+	aggregator.set_enabled(false);
+	aggregator.set_enabled(true);
+	EXPECT_FALSE(aggregator.is_enabled("toggled_metric"));
+
+	aggregator.set_enabled("toggled_metric", true);
+	record();
+	EXPECT_EQ(aggregator.times_entered("toggled_metric"), 2u);
+}
+
+TEST(collector, sampled_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_metric("sampled_metric");
+
+	for (int i = 0; i < 100; ++i) {
+		mtr::basic_collector<mtr::virtual_clock> collector(handle, 8);
+		mtr::virtual_clock::advance(std::chrono::nanoseconds(10));
+	}
+
+	EXPECT_EQ(aggregator.times_entered("sampled_metric"), 100u);
+	EXPECT_EQ(aggregator.total<std::chrono::nanoseconds>("sampled_metric"),
+	          std::chrono::nanoseconds(1000));
+	EXPECT_EQ(aggregator.average<std::chrono::nanoseconds>("sampled_metric"),
+	          std::chrono::nanoseconds(10));
+}
+
+TEST(collector, sampled_macro_test) {
+	for (int i = 0; i < 640; ++i) {
+		METRICS_RECORD_BLOCK_SAMPLED("sampled_macro_metric", 64);
+	}
+
+	const auto &aggregator = mtr::metric_aggregator::instance();
+	EXPECT_EQ(aggregator.times_entered("sampled_macro_metric"), 640u);
+}
+
+TEST(collector, adaptive_sampling_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto record = []() {
+		METRICS_RECORD_BLOCK_ADAPTIVE("adaptive_metric");
+	};
+
+	record();
+	EXPECT_EQ(aggregator.sampling_period("adaptive_metric"), 1u);
+
+	/* A budget this small cannot afford timing every entry. */
+	aggregator.set_overhead_budget(1e-9);
+	for (int i = 0; i < 100000; ++i) {
+		record();
+	}
+	aggregator.rebalance_sampling();
+	EXPECT_GT(aggregator.sampling_period("adaptive_metric"), 1u);
+	EXPECT_EQ(aggregator.times_entered("adaptive_metric"), 100001u);
+
+	std::ostringstream stream;
+	aggregator.dump_metrics<std::chrono::nanoseconds>("adaptive_metric", stream);
+	EXPECT_NE(stream.str().find("Sampling period: "), std::string::npos);
+
+	aggregator.set_overhead_budget(1.0);
+	record();
+	aggregator.rebalance_sampling();
+	EXPECT_EQ(aggregator.sampling_period("adaptive_metric"), 1u);
+
+	aggregator.set_overhead_budget(0.01);
+}
+
+TEST(collector, calibration_test) {
+	const auto &cost = mtr::detail::instrumentation_cost::measured();
+	EXPECT_GT(cost.skipped_nanoseconds, 0.0);
+	EXPECT_GT(cost.timed_nanoseconds, cost.skipped_nanoseconds);
+
+	/* The entries timed to measure the cost are not reported. */
+	std::ostringstream stream;
+	mtr::metric_aggregator::instance().dump_all<std::chrono::nanoseconds>(stream);
+	EXPECT_EQ(stream.str().find("mtr.calibration"), std::string::npos);
+}
@@ -0,0 +1,203 @@
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <string_view>
+#include <thread>
+#include <utility>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "mtr/metrics.hpp"
+
+using namespace ::testing;
+
+namespace {
+
+/* Runs eagerly until its first suspension and keeps the frame until the
+ * task is destroyed. */
+struct task {
+	struct promise_type : mtr::basic_timed_promise<mtr::virtual_clock> {
+		task get_return_object() {
+			return task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+		std::suspend_never initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+
+	explicit task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+	task(task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+	~task() {
+		if (handle) {
+			handle.destroy();
+		}
+	}
+
+	std::coroutine_handle<promise_type> handle;
+};
+
+/* Suspends until the test resumes the coroutine through `waiting`. */
+struct resume_later {
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> handle) noexcept { *waiting = handle; }
+	int await_resume() const noexcept { return 42; }
+
+	std::coroutine_handle<> *waiting;
+};
+
+/* Only awaitable through its operator co_await. */
+struct ready_later {
+	resume_later operator co_await() const { return resume_later{waiting}; }
+
+	std::coroutine_handle<> *waiting;
+};
+
+/* Decides in await_suspend not to suspend after all. */
+struct never_suspends {
+	bool await_ready() const noexcept { return false; }
+	bool await_suspend(std::coroutine_handle<>) const noexcept {
+		mtr::virtual_clock::advance(std::chrono::nanoseconds(3));
+		return false;
+	}
+	void await_resume() const noexcept {}
+};
+
+task two_waits(std::coroutine_handle<> *waiting, int *result) {
+	METRICS_RECORD_COROUTINE("coroutine_metric");
+	mtr::virtual_clock::advance(std::chrono::nanoseconds(10));
+	*result = co_await resume_later{waiting};
+	mtr::virtual_clock::advance(std::chrono::nanoseconds(5));
+	co_await ready_later{waiting};
+	co_await never_suspends{};
+	mtr::virtual_clock::advance(std::chrono::nanoseconds(1));
+}
+
+task waits_forever(std::coroutine_handle<> *waiting) {
+	METRICS_RECORD_COROUTINE("abandoned_coroutine_metric");
+	mtr::virtual_clock::advance(std::chrono::nanoseconds(8));
+	co_await resume_later{waiting};
+}
+
+task times_a_wait(mtr::metric_handle handle, std::coroutine_handle<> *waiting) {
+	mtr::basic_collector<mtr::virtual_clock> collector(handle);
+	co_await resume_later{waiting};
+}
+
+mtr::call_tree::node_id child_named(const mtr::call_tree &tree, mtr::call_tree::node_id parent,
+                                    std::string_view name) {
+	for (const auto child : tree.at(parent).children) {
+		if (tree.at(child).name == name) {
+			return child;
+		}
+	}
+	return mtr::call_tree::root;
+}
+
+} // namespace
+
+TEST(coroutine, active_and_suspended_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	std::coroutine_handle<> waiting;
+	int result = 0;
+
+	task coroutine = two_waits(&waiting, &result);
+	mtr::virtual_clock::advance(std::chrono::nanoseconds(100));
+	waiting.resume();
+	EXPECT_EQ(result, 42);
+
+	mtr::virtual_clock::advance(std::chrono::nanoseconds(200));
+	waiting.resume();
+	ASSERT_TRUE(coroutine.handle.done());
+
+	/* The coroutine is suspended while in await_suspend, even if it is
+	 * resumed right away. */
+	EXPECT_EQ(aggregator.times_entered("coroutine_metric.active"), 1u);
+	EXPECT_EQ(aggregator.total<std::chrono::nanoseconds>("coroutine_metric.active"),
+	          std::chrono::nanoseconds(16));
+	EXPECT_EQ(aggregator.times_entered("coroutine_metric.suspended"), 1u);
+	EXPECT_EQ(aggregator.total<std::chrono::nanoseconds>("coroutine_metric.suspended"),
+	          std::chrono::nanoseconds(303));
+}
+
+TEST(coroutine, destroyed_while_suspended_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	std::coroutine_handle<> waiting;
+
+	{
+		task coroutine = waits_forever(&waiting);
+		mtr::virtual_clock::advance(std::chrono::nanoseconds(50));
+		EXPECT_EQ(aggregator.times_entered("abandoned_coroutine_metric.active"), 0u);
+	}
+
+	EXPECT_EQ(aggregator.times_entered("abandoned_coroutine_metric.active"), 1u);
+	EXPECT_EQ(aggregator.total<std::chrono::nanoseconds>("abandoned_coroutine_metric.active"),
+	          std::chrono::nanoseconds(8));
+	EXPECT_EQ(
+	    aggregator.total<std::chrono::nanoseconds>("abandoned_coroutine_metric.suspended"),
+	    std::chrono::nanoseconds(50));
+}
+
+TEST(coroutine, disabled_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto metric = aggregator.register_coroutine("disabled_coroutine_metric");
+	aggregator.set_enabled("disabled_coroutine_metric.active", false);
+	aggregator.set_enabled("disabled_coroutine_metric.suspended", false);
+
+	mtr::basic_coroutine_timing<mtr::virtual_clock> timing;
+	timing.start(metric);
+	EXPECT_FALSE(timing.is_active());
+
+	timing.finish();
+	EXPECT_EQ(aggregator.times_entered("disabled_coroutine_metric.active"), 0u);
+}
+
+TEST(coroutine, block_resumed_on_another_thread_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	std::coroutine_handle<> waiting;
+
+	aggregator.set_call_tree(true);
+	{
+		METRICS_RECORD_BLOCK_WITH(mtr::virtual_clock, "migrating_outer");
+		task coroutine = times_a_wait(aggregator.register_metric("migrating_block"), &waiting);
+		std::thread([&] { waiting.resume(); }).join();
+		ASSERT_TRUE(coroutine.handle.done());
+
+		/* The block that ended on the other thread is no longer the parent. */
+		METRICS_RECORD_BLOCK_WITH(mtr::virtual_clock, "migrating_after");
+	}
+	aggregator.set_call_tree(false);
+	EXPECT_EQ(aggregator.times_entered("migrating_block"), 1u);
+
+	const auto tree = aggregator.call_tree();
+	const auto outer = child_named(tree, mtr::call_tree::root, "migrating_outer");
+	ASSERT_NE(outer, mtr::call_tree::root);
+	EXPECT_EQ(tree.at(outer).times_entered, 1u);
+	const auto after = child_named(tree, outer, "migrating_after");
+	ASSERT_NE(after, mtr::call_tree::root);
+	EXPECT_EQ(tree.at(after).times_entered, 1u);
+}
+
+TEST(coroutine, interleaved_blocks_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	std::coroutine_handle<> first_waiting;
+	std::coroutine_handle<> second_waiting;
+
+	aggregator.set_call_tree(true);
+	task first = times_a_wait(aggregator.register_metric("interleaved_first"), &first_waiting);
+	task second = times_a_wait(aggregator.register_metric("interleaved_second"), &second_waiting);
+	first_waiting.resume();
+	second_waiting.resume();
+	{ METRICS_RECORD_BLOCK_WITH(mtr::virtual_clock, "interleaved_after"); }
+	aggregator.set_call_tree(false);
+
+	/* Both blocks exited although the first was not the innermost one. */
+	const auto tree = aggregator.call_tree();
+	const auto outer = child_named(tree, mtr::call_tree::root, "interleaved_first");
+	ASSERT_NE(outer, mtr::call_tree::root);
+	EXPECT_EQ(tree.at(outer).times_entered, 1u);
+	const auto inner = child_named(tree, outer, "interleaved_second");
+	ASSERT_NE(inner, mtr::call_tree::root);
+	EXPECT_EQ(tree.at(inner).times_entered, 1u);
+	EXPECT_NE(child_named(tree, mtr::call_tree::root, "interleaved_after"), mtr::call_tree::root);
+}
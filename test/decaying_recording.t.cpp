@@ -0,0 +1,71 @@
+#include <gmock/gmock-matchers.h>
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "mtr/metrics.hpp"
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+
+using namespace ::testing;
+
+namespace {
+
+constexpr std::uint64_t seconds(std::uint64_t count) {
+    return count * 1'000'000'000;
+}
+
+} // namespace
+
+TEST(decaying_recording, steady_rate_test) {
+    /* Ten entries per second for two hours settle every horizon on that rate. */
+    mtr::decaying_recording recording;
+    for (std::uint64_t i = 0; i < 72'000; ++i) {
+        recording.update(std::chrono::nanoseconds(100), i * seconds(1) / 10);
+    }
+
+    const std::uint64_t now = seconds(7200);
+    EXPECT_NEAR(recording.rate(mtr::decay_horizon::one_minute, now), 10.0, 0.1);
+    EXPECT_NEAR(recording.rate(mtr::decay_horizon::five_minutes, now), 10.0, 0.1);
+    EXPECT_NEAR(recording.rate(mtr::decay_horizon::fifteen_minutes, now), 10.0, 0.1);
+    EXPECT_THAT(recording.average(mtr::decay_horizon::one_minute),
+                std::chrono::nanoseconds(100));
+}
+
+TEST(decaying_recording, decay_test) {
+    mtr::decaying_recording recording;
+    recording.update(std::chrono::nanoseconds(100), seconds(0));
+    recording.update(std::chrono::nanoseconds(300), seconds(60));
+
+    /* The older entry weighs 1/e of the newer one over a minute. */
+    const double weight = std::exp(-1.0);
+    EXPECT_NEAR(recording.rate(mtr::decay_horizon::one_minute, seconds(60)),
+                (1.0 + weight) / 60.0, 1e-9);
+    EXPECT_THAT(recording.average(mtr::decay_horizon::one_minute),
+                std::chrono::nanoseconds(std::llround((300.0 + 100.0 * weight) / (1.0 + weight))));
+
+    /* Reading the rate later decays it without recording anything. */
+    EXPECT_NEAR(recording.rate(mtr::decay_horizon::one_minute, seconds(120)),
+                (weight + weight * weight) / 60.0, 1e-9);
+}
+
+TEST(decaying_recording, merge_test) {
+    mtr::decaying_recording lhs;
+    lhs.update(std::chrono::nanoseconds(100), seconds(0));
+
+    mtr::decaying_recording rhs;
+    rhs.update(std::chrono::nanoseconds(300), seconds(60));
+
+    mtr::decaying_recording expected;
+    expected.update(std::chrono::nanoseconds(100), seconds(0));
+    expected.update(std::chrono::nanoseconds(300), seconds(60));
+
+    lhs.merge(rhs);
+
+    for (const auto horizon : {mtr::decay_horizon::one_minute, mtr::decay_horizon::five_minutes,
+                               mtr::decay_horizon::fifteen_minutes}) {
+        EXPECT_NEAR(lhs.rate(horizon, seconds(90)), expected.rate(horizon, seconds(90)), 1e-12);
+        EXPECT_THAT(lhs.average(horizon), expected.average(horizon));
+    }
+}
@@ -0,0 +1,61 @@
+#include <cstdint>
+#include <limits>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "mtr/metrics.hpp"
+
+using namespace ::testing;
+
+TEST(histogram, bucket_index_test) {
+	using histogram = mtr::basic_histogram<3>;
+
+	for (std::uint64_t value = 0; value < 8; ++value) {
+		EXPECT_EQ(histogram::bucket_index(value), value);
+	}
+
+	/* Every value falls within the bounds of its bucket. */
+	for (std::uint64_t value = 1; value < (std::uint64_t{1} << 62); value = value * 3 + 1) {
+		const auto index = histogram::bucket_index(value);
+		EXPECT_LE(histogram::bucket_lower_bound(index), value);
+		EXPECT_GE(histogram::bucket_upper_bound(index), value);
+	}
+
+	const auto max = std::numeric_limits<std::uint64_t>::max();
+	EXPECT_EQ(histogram::bucket_index(max), histogram::bucket_count - 1);
+	EXPECT_EQ(histogram::bucket_upper_bound(histogram::bucket_count - 1), max);
+}
+
+TEST(histogram, bucket_bounds_test) {
+	using histogram = mtr::basic_histogram<4>;
+
+	/* Buckets are contiguous and at most 1/16th as wide as their lower bound. */
+	for (std::size_t index = 1; index < histogram::bucket_count; ++index) {
+		EXPECT_EQ(histogram::bucket_lower_bound(index),
+		          histogram::bucket_upper_bound(index - 1) + 1);
+
+		const auto lower = histogram::bucket_lower_bound(index);
+		const auto width = histogram::bucket_upper_bound(index) - lower + 1;
+		EXPECT_LE(width, std::max<std::uint64_t>(lower / 16, 1));
+	}
+}
+
+TEST(histogram, value_at_quantile_test) {
+	mtr::histogram histogram;
+	EXPECT_EQ(histogram.value_at_quantile(0.5), 0u);
+
+	for (std::uint64_t value = 1; value <= 10000; ++value) {
+		histogram.record(value);
+	}
+	EXPECT_EQ(histogram.count(), 10000u);
+
+	EXPECT_NEAR(histogram.value_at_quantile(0.5), 5000, 5000 / 16);
+	EXPECT_NEAR(histogram.value_at_quantile(0.9), 9000, 9000 / 16);
+	EXPECT_NEAR(histogram.value_at_quantile(0.999), 9990, 9990 / 16);
+
+	mtr::histogram other;
+	other.record(1u << 20);
+	histogram.merge(other);
+	EXPECT_EQ(histogram.count(), 10001u);
+	EXPECT_NEAR(histogram.value_at_quantile(1.0), 1u << 20, (1u << 20) / 16);
+}
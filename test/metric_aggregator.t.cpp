@@ -1,6 +1,14 @@
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cstdio>
+#include <csignal>
+#include <fstream>
+#include <limits>
+#include <map>
 #include <sstream>
 #include <thread>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "gtest/gtest.h"
@@ -8,6 +16,44 @@
 
 using namespace ::testing;
 
+struct proto_field {
+    std::uint32_t number;
+    std::uint64_t value;
+    std::string bytes;
+};
+
+/* Splits a protocol buffer message into its varint and length delimited fields. */
+std::vector<proto_field> parse_proto(const std::string &message) {
+    std::size_t offset = 0;
+    const auto varint = [&]() {
+        std::uint64_t value = 0;
+        for (int shift = 0; offset < message.size(); shift += 7) {
+            const auto byte = static_cast<unsigned char>(message[offset++]);
+            value |= std::uint64_t{byte & 0x7fu} << shift;
+            if (byte < 0x80) {
+                break;
+            }
+        }
+        return value;
+    };
+
+    std::vector<proto_field> fields;
+    while (offset < message.size()) {
+        const auto key = varint();
+        proto_field field{static_cast<std::uint32_t>(key >> 3), 0, {}};
+        if ((key & 7) == 0) {
+            field.value = varint();
+        } else {
+            const auto size = varint();
+            field.bytes = message.substr(offset, size);
+            offset += size;
+        }
+        fields.push_back(field);
+    }
+
+    return fields;
+}
+
 int count_occurences(const std::string &str, const std::string &sub) {
     if (sub.length() == 0) {
         return 0;
@@ -29,11 +75,11 @@ TEST(metric_aggregator, macro_test) {
 	}
 
 	const auto &aggregator = mtr::metric_aggregator::instance();
-	EXPECT_EQ(aggregator.times_entered("test_metric"), 100);
+	EXPECT_EQ(aggregator.times_entered("test_metric"), 100u);
 	EXPECT_TRUE(aggregator.max<std::chrono::nanoseconds>("test_metric") >=
 	            std::chrono::nanoseconds(10));
 
-	EXPECT_EQ(aggregator.times_entered("i_don't_exist"), 0);
+	EXPECT_EQ(aggregator.times_entered("i_don't_exist"), 0u);
 	EXPECT_EQ(aggregator.max<std::chrono::nanoseconds>("i_don't_exist"),
 	          std::chrono::nanoseconds(0));
 }
@@ -51,8 +97,8 @@ TEST(metric_aggregator, macro_nested_test) {
 
 	const auto &aggregator = mtr::metric_aggregator::instance();
 
-	EXPECT_EQ(aggregator.times_entered("foo"), 1);
-	EXPECT_EQ(aggregator.times_entered("foo_loop"), 150);
+	EXPECT_EQ(aggregator.times_entered("foo"), 1u);
+	EXPECT_EQ(aggregator.times_entered("foo_loop"), 150u);
 
 	EXPECT_GE(aggregator.total<std::chrono::microseconds>("foo"),
 	            std::chrono::microseconds(1));
@@ -84,11 +130,47 @@ TEST(metric_aggregator, dump_metrics_test) {
     const auto &aggregator = mtr::metric_aggregator::instance();
     aggregator.dump_metrics<std::chrono::nanoseconds>("bar", sstream);
     
-    EXPECT_EQ(count_occurences(sstream.str(), "ns"), 4);
+    EXPECT_EQ(count_occurences(sstream.str(), "ns"), 13);
 
     std::ostringstream sstream_;
     aggregator.dump_metrics<std::chrono::minutes>("bar", sstream_);
-    EXPECT_EQ(count_occurences(sstream.str(), "s"), 5);
+    EXPECT_EQ(count_occurences(sstream.str(), "s"), 20);
+}
+
+TEST(metric_aggregator, dump_snapshot_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_metric("dump_snapshot_metric");
+
+	std::atomic<bool> done{false};
+	std::thread recorder([&] {
+		while (not done.load()) {
+			aggregator.update_metric(handle, std::chrono::nanoseconds(10));
+		}
+	});
+
+	while (aggregator.times_entered("dump_snapshot_metric") == 0) {
+		std::this_thread::yield();
+	}
+
+	/* Every entry takes 10ns, so the lines agree only if they come from the
+	 * same snapshot. */
+	for (int i = 0; i < 100; ++i) {
+		std::ostringstream stream;
+		aggregator.dump_metrics<std::chrono::nanoseconds>("dump_snapshot_metric", stream);
+
+		std::istringstream lines(stream.str());
+		std::string line;
+		long long entered = 0;
+		long long total = 0;
+		while (std::getline(lines, line)) {
+			std::sscanf(line.c_str(), "\tEntered: %lld", &entered);
+			std::sscanf(line.c_str(), "\tTotal: %lldns", &total);
+		}
+		EXPECT_EQ(total, entered * 10);
+	}
+
+	done.store(true);
+	recorder.join();
 }
 
 TEST(metric_aggregator, stringify_unit_test) {
@@ -98,3 +180,701 @@ TEST(metric_aggregator, stringify_unit_test) {
     EXPECT_EQ(mtr::stringify_unit<std::chrono::seconds>::value, "s");
     EXPECT_EQ(mtr::stringify_unit<std::chrono::minutes>::value, "s");
 }
+
+TEST(metric_aggregator, handle_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+
+	const auto handle = aggregator.register_metric("handle_metric");
+	EXPECT_EQ(handle.id(), aggregator.register_metric("handle_metric").id());
+	EXPECT_NE(handle.id(), aggregator.register_metric("other_handle_metric").id());
+	EXPECT_EQ(aggregator.times_entered("handle_metric"), 0u);
+	EXPECT_EQ(aggregator.average<std::chrono::nanoseconds>("handle_metric"),
+	          std::chrono::nanoseconds(0));
+
+	aggregator.update_metric(handle, std::chrono::nanoseconds(10));
+	aggregator.update_metric("handle_metric", std::chrono::nanoseconds(30));
+
+	EXPECT_EQ(aggregator.times_entered("handle_metric"), 2u);
+	EXPECT_EQ(aggregator.total<std::chrono::nanoseconds>("handle_metric"),
+	          std::chrono::nanoseconds(40));
+}
+
+TEST(metric_aggregator, multi_threaded_test) {
+	constexpr int thread_count = 8;
+	constexpr int iterations = 1000;
+
+	const auto &aggregator = mtr::metric_aggregator::instance();
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < thread_count; ++t) {
+		threads.emplace_back([&aggregator]() {
+			for (int i = 0; i < iterations; ++i) {
+				METRICS_RECORD_BLOCK("threaded_metric");
+				/* Read while other threads are recording. */
+				(void) aggregator.times_entered("threaded_metric");
+			}
+		});
+	}
+
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	EXPECT_EQ(aggregator.times_entered("threaded_metric"),
+	          static_cast<std::size_t>(thread_count * iterations));
+	EXPECT_LE(aggregator.min<std::chrono::nanoseconds>("threaded_metric"),
+	          aggregator.max<std::chrono::nanoseconds>("threaded_metric"));
+}
+
+TEST(metric_aggregator, atomic_storage_test) {
+	constexpr int thread_count = 8;
+	constexpr int iterations = 1000;
+
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle =
+	    aggregator.register_metric("atomic_metric", mtr::metric_storage::shared_atomic);
+	EXPECT_EQ(handle.id(), aggregator.register_metric("atomic_metric").id());
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < thread_count; ++t) {
+		threads.emplace_back([]() {
+			for (int i = 0; i < iterations; ++i) {
+				METRICS_RECORD_BLOCK_ATOMIC("atomic_metric");
+			}
+		});
+	}
+
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	aggregator.update_metric(handle, std::chrono::hours(1));
+
+	EXPECT_EQ(aggregator.times_entered("atomic_metric"),
+	          static_cast<std::size_t>(thread_count * iterations + 1));
+	EXPECT_EQ(aggregator.max<std::chrono::hours>("atomic_metric"), std::chrono::hours(1));
+}
+
+TEST(metric_aggregator, percentile_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_metric("percentile_metric");
+	for (int i = 1; i <= 1000; ++i) {
+		aggregator.update_metric(handle, std::chrono::microseconds(i));
+	}
+
+	const auto p50 = aggregator.percentile<std::chrono::microseconds>("percentile_metric", 0.5);
+	const auto p99 = aggregator.percentile<std::chrono::microseconds>("percentile_metric", 0.99);
+	EXPECT_NEAR(p50.count(), 500, 500 / 16);
+	EXPECT_NEAR(p99.count(), 990, 990 / 16);
+	EXPECT_EQ(aggregator.percentile<std::chrono::microseconds>("percentile_metric", 1.0),
+	          std::chrono::microseconds(1000));
+	EXPECT_EQ(aggregator.percentile<std::chrono::microseconds>("i_don't_exist", 0.5),
+	          std::chrono::microseconds(0));
+
+	std::ostringstream stream;
+	aggregator.dump_metrics<std::chrono::microseconds>("percentile_metric", stream);
+	EXPECT_NE(stream.str().find("P99.9: "), std::string::npos);
+}
+
+TEST(metric_aggregator, stddev_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto steady = aggregator.register_metric("steady_metric");
+	const auto jittery = aggregator.register_metric("jittery_metric");
+	for (int i = 0; i < 100; ++i) {
+		aggregator.update_metric(steady, std::chrono::microseconds(50));
+		aggregator.update_metric(jittery, std::chrono::microseconds(i % 2 == 0 ? 1 : 99));
+	}
+
+	EXPECT_EQ(aggregator.stddev<std::chrono::microseconds>("steady_metric"),
+	          std::chrono::microseconds(0));
+	EXPECT_EQ(aggregator.stddev<std::chrono::microseconds>("jittery_metric"),
+	          std::chrono::microseconds(49));
+	EXPECT_DOUBLE_EQ(aggregator.variance<std::chrono::microseconds>("jittery_metric"),
+	                 49.0 * 49.0);
+	EXPECT_EQ(aggregator.stddev<std::chrono::microseconds>("i_don't_exist"),
+	          std::chrono::microseconds(0));
+}
+
+TEST(metric_aggregator, window_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_metric("windowed_metric");
+	aggregator.update_metric(handle, std::chrono::microseconds(10));
+	aggregator.update_metric(handle, std::chrono::microseconds(30));
+
+	/* Entries of an exited thread stay in the window. */
+	std::thread([&] { aggregator.update_metric(handle, std::chrono::microseconds(50)); }).join();
+
+	const auto last = std::chrono::minutes(1);
+	EXPECT_EQ(aggregator.times_entered("windowed_metric", last), 3u);
+	EXPECT_EQ(aggregator.min<std::chrono::microseconds>("windowed_metric", last),
+	          std::chrono::microseconds(10));
+	EXPECT_EQ(aggregator.max<std::chrono::microseconds>("windowed_metric", last),
+	          std::chrono::microseconds(50));
+	EXPECT_EQ(aggregator.average<std::chrono::microseconds>("windowed_metric", last),
+	          std::chrono::microseconds(30));
+	EXPECT_EQ(aggregator.total<std::chrono::microseconds>("windowed_metric", last),
+	          std::chrono::microseconds(90));
+	EXPECT_EQ(aggregator.times_entered("i_don't_exist", last), 0u);
+}
+
+TEST(metric_aggregator, sampled_window_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_metric("sampled_windowed_metric");
+	for (int i = 0; i < 100; ++i) {
+		mtr::basic_collector<mtr::virtual_clock> collector(handle, 4);
+		mtr::virtual_clock::advance(std::chrono::nanoseconds(10));
+	}
+
+	/* One in four entries was timed; the window is extrapolated like the totals. */
+	const auto last = std::chrono::minutes(1);
+	EXPECT_EQ(aggregator.times_entered("sampled_windowed_metric", last), 100u);
+	EXPECT_EQ(aggregator.total<std::chrono::nanoseconds>("sampled_windowed_metric", last),
+	          std::chrono::nanoseconds(1000));
+	EXPECT_EQ(aggregator.total<std::chrono::nanoseconds>("sampled_windowed_metric", last),
+	          aggregator.total<std::chrono::nanoseconds>("sampled_windowed_metric"));
+	EXPECT_EQ(aggregator.average<std::chrono::nanoseconds>("sampled_windowed_metric", last),
+	          std::chrono::nanoseconds(10));
+}
+
+TEST(metric_aggregator, decaying_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_metric("decaying_metric");
+	aggregator.update_metric(handle, std::chrono::microseconds(10));
+	std::thread([&] { aggregator.update_metric(handle, std::chrono::microseconds(30)); }).join();
+
+	/* Both entries were just recorded, so they have barely decayed. */
+	EXPECT_NEAR(aggregator.rate("decaying_metric", mtr::decay_horizon::one_minute), 2.0 / 60.0,
+	            1e-3);
+	EXPECT_EQ(aggregator.decayed_average<std::chrono::microseconds>(
+	              "decaying_metric", mtr::decay_horizon::fifteen_minutes),
+	          std::chrono::microseconds(20));
+	EXPECT_EQ(aggregator.rate("i_don't_exist", mtr::decay_horizon::one_minute), 0.0);
+}
+
+TEST(metric_aggregator, counter_test) {
+	const auto send = [](std::int64_t bytes) { METRICS_COUNT("bytes_sent", bytes); };
+
+	std::vector<std::thread> threads;
+	for (int i = 0; i < 4; ++i) {
+		threads.emplace_back([&] {
+			for (int j = 0; j < 1000; ++j) {
+				send(3);
+			}
+		});
+	}
+	for (auto &thread : threads) {
+		thread.join();
+	}
+	send(2);
+
+	auto &aggregator = mtr::metric_aggregator::instance();
+	EXPECT_EQ(aggregator.counter("bytes_sent"), 4 * 1000 * 3 + 2);
+	EXPECT_EQ(aggregator.counter("i_don't_exist"), 0);
+
+	aggregator.set_enabled("bytes_sent", false);
+	send(100);
+	aggregator.set_enabled("bytes_sent", true);
+	EXPECT_EQ(aggregator.counter("bytes_sent"), 4 * 1000 * 3 + 2);
+
+	std::ostringstream stream;
+	aggregator.dump_metrics<std::chrono::nanoseconds>("bytes_sent", stream);
+	EXPECT_EQ(stream.str(), "bytes_sent metrics:\n\tCount: 12002\n");
+}
+
+TEST(metric_aggregator, counter_index_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto first = aggregator.register_counter("indexed_counter_first");
+	const auto timer = aggregator.register_metric("indexed_counter_timer");
+	const auto second = aggregator.register_counter("indexed_counter_second");
+
+	std::thread([&] {
+		aggregator.increment(second, 5);
+		aggregator.increment(timer, 7);
+	}).join();
+	aggregator.increment(first, 2);
+	aggregator.increment(second, 1);
+
+	/* Counters of other metrics and increments of other kinds do not mix. */
+	EXPECT_EQ(aggregator.counter("indexed_counter_first"), 2);
+	EXPECT_EQ(aggregator.counter("indexed_counter_second"), 6);
+	EXPECT_EQ(aggregator.counter("indexed_counter_timer"), 0);
+	EXPECT_EQ(aggregator.times_entered("indexed_counter_timer"), 0u);
+}
+
+TEST(metric_aggregator, switched_before_registration_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto send = [](std::int64_t bytes) { METRICS_COUNT("switched_counter", bytes); };
+
+	/* As configuration read on startup would, before any metric is used. */
+	aggregator.set_enabled("switched_counter", false);
+	aggregator.set_enabled("switched_value", true);
+	EXPECT_FALSE(aggregator.is_enabled("switched_counter"));
+
+	send(5);
+	EXPECT_EQ(aggregator.counter("switched_counter"), 0);
+	aggregator.set_enabled("switched_counter", true);
+	send(3);
+	EXPECT_EQ(aggregator.counter("switched_counter"), 3);
+
+	const auto rows = aggregator.register_value_metric("switched_value", " rows");
+	aggregator.record_value(rows, 2.5);
+	EXPECT_DOUBLE_EQ(aggregator.max<double>("switched_value"), 2.5);
+
+	std::ostringstream stream;
+	aggregator.dump_metrics<std::chrono::nanoseconds>("switched_counter", stream);
+	aggregator.dump_metrics<std::chrono::nanoseconds>("switched_value", stream);
+	EXPECT_NE(stream.str().find("switched_counter metrics:\n\tCount: 3\n"), std::string::npos);
+	EXPECT_NE(stream.str().find("2.5 rows"), std::string::npos);
+}
+
+TEST(metric_aggregator, gauge_test) {
+	const auto resize = [](std::size_t depth) { METRICS_GAUGE("queue_depth", depth); };
+
+	auto &aggregator = mtr::metric_aggregator::instance();
+	resize(10);
+	EXPECT_EQ(aggregator.gauge("queue_depth"), 10.0);
+	std::thread([&] { resize(7); }).join();
+	EXPECT_EQ(aggregator.gauge("queue_depth"), 7.0);
+	EXPECT_EQ(aggregator.gauge("i_don't_exist"), 0.0);
+
+	std::ostringstream stream;
+	aggregator.dump_metrics<std::chrono::nanoseconds>("queue_depth", stream);
+	EXPECT_EQ(stream.str(), "queue_depth metrics:\n\tValue: 7\n");
+}
+
+TEST(metric_aggregator, value_test) {
+	const auto batch = [](int rows) { METRICS_RECORD_VALUE_WITH_UNIT("batch_rows", rows, " rows"); };
+	const auto ratio = [](double value) { METRICS_RECORD_VALUE("hit_ratio", value); };
+
+	for (int rows = 1; rows <= 100; ++rows) {
+		batch(rows);
+	}
+	ratio(0.25);
+	ratio(0.75);
+	ratio(-1.0);
+
+	const auto &aggregator = mtr::metric_aggregator::instance();
+	EXPECT_EQ(aggregator.times_entered("batch_rows"), 100u);
+	EXPECT_EQ(aggregator.min<int>("batch_rows"), 1);
+	EXPECT_EQ(aggregator.max<int>("batch_rows"), 100);
+	EXPECT_EQ(aggregator.total<long>("batch_rows"), 5050);
+	EXPECT_DOUBLE_EQ(aggregator.average<double>("batch_rows"), 50.5);
+	EXPECT_NEAR(aggregator.percentile<double>("batch_rows", 0.9), 90.0, 90.0 * 0.07);
+	EXPECT_NEAR(aggregator.variance<double>("batch_rows"), (100.0 * 100.0 - 1.0) / 12.0, 1e-6);
+
+	/* Fractions are kept, negative values are recorded as 0. */
+	EXPECT_DOUBLE_EQ(aggregator.total<double>("hit_ratio"), 1.0);
+	EXPECT_DOUBLE_EQ(aggregator.min<double>("hit_ratio"), 0.0);
+
+	std::ostringstream stream;
+	aggregator.dump_metrics<std::chrono::nanoseconds>("batch_rows", stream);
+	EXPECT_NE(stream.str().find("Total: 5050 rows\n"), std::string::npos);
+	EXPECT_NE(stream.str().find("Max: 100 rows\n"), std::string::npos);
+	EXPECT_EQ(stream.str().find("ns"), std::string::npos);
+}
+
+TEST(metric_aggregator, value_range_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto record = [&aggregator](const char *name, auto value) {
+		aggregator.record_value(aggregator.register_value_metric(name), value);
+	};
+
+	/* Values too large for the fixed point representation saturate. */
+	record("huge_int", std::numeric_limits<std::int64_t>::max());
+	record("huge_unsigned", std::numeric_limits<std::uint64_t>::max());
+	record("huge_double", 1e300);
+	const auto max_value = static_cast<double>(mtr::detail::max_value);
+	EXPECT_DOUBLE_EQ(aggregator.max<double>("huge_int"), max_value);
+	EXPECT_DOUBLE_EQ(aggregator.max<double>("huge_unsigned"), max_value);
+	EXPECT_DOUBLE_EQ(aggregator.max<double>("huge_double"), max_value);
+
+	record("negative_int", std::numeric_limits<std::int64_t>::min());
+	EXPECT_DOUBLE_EQ(aggregator.max<double>("negative_int"), 0.0);
+
+	/* Values are kept to three decimals. */
+	record("tiny_double", 0.0004);
+	record("tiny_double", 0.0006);
+	record("tiny_double", std::numeric_limits<double>::quiet_NaN());
+	EXPECT_EQ(aggregator.times_entered("tiny_double"), 3u);
+	EXPECT_DOUBLE_EQ(aggregator.min<double>("tiny_double"), 0.0);
+	EXPECT_DOUBLE_EQ(aggregator.total<double>("tiny_double"), 0.001);
+}
+
+TEST(metric_aggregator, value_total_range_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_value_metric("huge_sum");
+
+	/* The values fit, their sum does not. */
+	std::thread([&] { aggregator.record_value(handle, 5e15); }).join();
+	aggregator.record_value(handle, 5e15);
+	aggregator.record_value(handle, 5e15);
+
+	const auto max_value = static_cast<double>(std::chrono::nanoseconds::max().count()) /
+	                       static_cast<double>(mtr::detail::value_scale);
+	EXPECT_EQ(aggregator.times_entered("huge_sum"), 3u);
+	EXPECT_DOUBLE_EQ(aggregator.total<double>("huge_sum"), max_value);
+	EXPECT_DOUBLE_EQ(aggregator.average<double>("huge_sum"), max_value / 3);
+	EXPECT_DOUBLE_EQ(aggregator.total<double>("huge_sum", std::chrono::seconds(60)), max_value);
+	EXPECT_GT(aggregator.average<double>("huge_sum", std::chrono::seconds(60)), 0.0);
+}
+
+TEST(metric_aggregator, slowest_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_metric("slowest_metric");
+
+	std::thread([&] {
+		mtr::set_call_context(7);
+		aggregator.update_metric(handle, std::chrono::milliseconds(5));
+	}).join();
+
+	mtr::set_call_context(42);
+	for (int i = 0; i < 100; ++i) {
+		aggregator.update_metric(handle, std::chrono::microseconds(i));
+	}
+	mtr::set_call_context(0);
+
+	const auto calls = aggregator.slowest("slowest_metric");
+	ASSERT_EQ(calls.size(), mtr::slowest_calls::capacity);
+	EXPECT_EQ(calls[0].elapsed, std::chrono::milliseconds(5));
+	EXPECT_EQ(calls[0].context, 7u);
+	EXPECT_NE(calls[0].thread, std::this_thread::get_id());
+	EXPECT_EQ(calls[1].elapsed, std::chrono::microseconds(99));
+	EXPECT_EQ(calls[1].context, 42u);
+	EXPECT_EQ(calls[1].thread, std::this_thread::get_id());
+	EXPECT_TRUE(aggregator.slowest("i_don't_exist").empty());
+
+	std::ostringstream stream;
+	aggregator.dump_metrics<std::chrono::microseconds>("slowest_metric", stream);
+	EXPECT_NE(stream.str().find("\t\t5000us at "), std::string::npos);
+	EXPECT_NE(stream.str().find(", context 42\n"), std::string::npos);
+}
+
+TEST(metric_aggregator, call_tree_test) {
+	const auto tick = [](int nanoseconds) {
+		mtr::virtual_clock::advance(std::chrono::nanoseconds(nanoseconds));
+	};
+	const auto leaf = [&]() {
+		METRICS_RECORD_BLOCK_WITH(mtr::virtual_clock, "tree_leaf");
+		tick(10);
+	};
+
+	auto &aggregator = mtr::metric_aggregator::instance();
+	aggregator.set_call_tree(true);
+	{
+		METRICS_RECORD_BLOCK_WITH(mtr::virtual_clock, "tree_parent");
+		tick(5);
+		for (int i = 0; i < 3; ++i) {
+			METRICS_RECORD_BLOCK_WITH(mtr::virtual_clock, "tree_child");
+			tick(1);
+			leaf();
+		}
+	}
+	std::thread(leaf).join();
+	aggregator.set_call_tree(false);
+
+	/* Blocks are left out while the call tree is off. */
+	leaf();
+
+	const auto tree = aggregator.call_tree();
+	const auto child_named = [&](mtr::call_tree::node_id parent, std::string_view name) {
+		for (const auto child : tree.at(parent).children) {
+			if (tree.at(child).name == name) {
+				return child;
+			}
+		}
+		return mtr::call_tree::root;
+	};
+
+	const auto parent = child_named(mtr::call_tree::root, "tree_parent");
+	ASSERT_NE(parent, mtr::call_tree::root);
+	EXPECT_EQ(tree.at(parent).times_entered, 1u);
+	EXPECT_EQ(tree.at(parent).inclusive, std::chrono::nanoseconds(38));
+	EXPECT_EQ(tree.at(parent).self(), std::chrono::nanoseconds(5));
+
+	const auto child = child_named(parent, "tree_child");
+	ASSERT_NE(child, mtr::call_tree::root);
+	EXPECT_EQ(tree.at(child).times_entered, 3u);
+	EXPECT_EQ(tree.at(child).inclusive, std::chrono::nanoseconds(33));
+	EXPECT_EQ(tree.at(child).self(), std::chrono::nanoseconds(3));
+
+	/* The same block has a node per path it is entered on. */
+	const auto nested_leaf = child_named(child, "tree_leaf");
+	ASSERT_NE(nested_leaf, mtr::call_tree::root);
+	EXPECT_EQ(tree.at(nested_leaf).times_entered, 3u);
+	const auto top_leaf = child_named(mtr::call_tree::root, "tree_leaf");
+	ASSERT_NE(top_leaf, mtr::call_tree::root);
+	EXPECT_EQ(tree.at(top_leaf).times_entered, 1u);
+	EXPECT_EQ(tree.at(top_leaf).self(), std::chrono::nanoseconds(10));
+
+	std::ostringstream stream;
+	aggregator.dump_call_tree<std::chrono::nanoseconds>(stream);
+	EXPECT_NE(stream.str().find("\ttree_parent: 1 entered, 38ns inclusive, 5ns self\n"
+	                            "\t\ttree_child: 3 entered, 33ns inclusive, 3ns self\n"
+	                            "\t\t\ttree_leaf: 3 entered, 30ns inclusive, 30ns self\n"),
+	          std::string::npos);
+}
+
+TEST(metric_aggregator, call_tree_reused_shard_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto stale_handle = aggregator.register_metric("reused_shard_stale");
+	const auto innocent_handle = aggregator.register_metric("reused_shard_innocent");
+	aggregator.set_call_tree(true);
+
+	/* Threads started one after the other usually get their shard at the
+	 * same address, so the frame of the exited thread looks like one of the
+	 * new thread's unless they are told apart. */
+	mtr::detail::block_frame stale;
+	std::thread([&] { stale = aggregator.enter_block(stale_handle); }).join();
+	std::thread([&] {
+		const auto innocent = aggregator.enter_block(innocent_handle);
+		aggregator.exit_block(stale, std::chrono::nanoseconds(5));
+		aggregator.exit_block(innocent, std::chrono::nanoseconds(7));
+	}).join();
+	aggregator.set_call_tree(false);
+
+	const auto tree = aggregator.call_tree();
+	for (const auto child : tree.at(mtr::call_tree::root).children) {
+		if (tree.at(child).name == "reused_shard_innocent") {
+			EXPECT_EQ(tree.at(child).times_entered, 1u);
+			EXPECT_EQ(tree.at(child).inclusive, std::chrono::nanoseconds(7));
+		}
+		if (tree.at(child).name == "reused_shard_stale") {
+			EXPECT_EQ(tree.at(child).times_entered, 0u);
+		}
+	}
+}
+
+TEST(metric_aggregator, sampled_call_tree_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto parent_handle = aggregator.register_metric("sampled_tree_parent");
+	aggregator.set_call_tree(true);
+	for (int i = 0; i < 4; ++i) {
+		mtr::basic_collector<mtr::virtual_clock> parent(parent_handle, 2);
+		METRICS_RECORD_BLOCK_WITH(mtr::virtual_clock, "sampled_tree_child");
+	}
+	aggregator.set_call_tree(false);
+
+	/* The children of the entries that were not timed are left out rather
+	 * than attached to the root. */
+	EXPECT_EQ(aggregator.times_entered("sampled_tree_child"), 4u);
+	std::ostringstream stream("\n", std::ios::ate);
+	aggregator.dump_folded_stacks(stream, mtr::folded_weight::count);
+	EXPECT_NE(stream.str().find("\nsampled_tree_parent;sampled_tree_child 2\n"),
+	          std::string::npos);
+	EXPECT_EQ(stream.str().find("\nsampled_tree_child "), std::string::npos);
+}
+
+TEST(metric_aggregator, mixed_clock_call_tree_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	aggregator.set_call_tree(true);
+	{
+		/* The outer block's clock does not advance while the inner one's does. */
+		METRICS_RECORD_BLOCK_WITH(mtr::virtual_clock, "mixed_outer");
+		METRICS_RECORD_BLOCK_WITH(mtr::steady_clock, "mixed_inner");
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	aggregator.set_call_tree(false);
+
+	std::ostringstream folded("\n", std::ios::ate);
+	aggregator.dump_folded_stacks(folded);
+	EXPECT_EQ(folded.str().find("\nmixed_outer "), std::string::npos);
+	EXPECT_NE(folded.str().find("\nmixed_outer;mixed_inner "), std::string::npos);
+
+	std::ostringstream tree;
+	aggregator.dump_call_tree<std::chrono::nanoseconds>(tree);
+	EXPECT_NE(tree.str().find("\tmixed_outer: 1 entered, 0ns inclusive, 0ns self\n"),
+	          std::string::npos);
+}
+
+TEST(metric_aggregator, folded_stacks_test) {
+	const auto tick = [](int nanoseconds) {
+		mtr::virtual_clock::advance(std::chrono::nanoseconds(nanoseconds));
+	};
+
+	auto &aggregator = mtr::metric_aggregator::instance();
+	aggregator.set_call_tree(true);
+	{
+		METRICS_RECORD_BLOCK_WITH(mtr::virtual_clock, "folded_root");
+		tick(4);
+		for (int i = 0; i < 2; ++i) {
+			METRICS_RECORD_BLOCK_WITH(mtr::virtual_clock, "folded;leaf");
+			tick(3);
+		}
+	}
+	aggregator.set_call_tree(false);
+
+	/* Lines are matched whole, including the first one. */
+	std::ostringstream by_time("\n", std::ios::ate);
+	aggregator.dump_folded_stacks(by_time);
+	EXPECT_NE(by_time.str().find("\nfolded_root 4\n"), std::string::npos);
+	EXPECT_NE(by_time.str().find("\nfolded_root;folded:leaf 6\n"), std::string::npos);
+
+	std::ostringstream by_count("\n", std::ios::ate);
+	aggregator.dump_folded_stacks(by_count, mtr::folded_weight::count);
+	EXPECT_NE(by_count.str().find("\nfolded_root 1\n"), std::string::npos);
+	EXPECT_NE(by_count.str().find("\nfolded_root;folded:leaf 2\n"), std::string::npos);
+}
+
+TEST(metric_aggregator, chrome_trace_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto record = []() {
+		METRICS_RECORD_BLOCK("traced \"outer\"");
+		METRICS_RECORD_BLOCK("traced_inner");
+	};
+
+	/* Drop whatever earlier tests buffered. */
+	std::ostringstream discarded;
+	aggregator.write_chrome_trace(discarded);
+
+	record();
+	EXPECT_FALSE(aggregator.is_tracing());
+
+	aggregator.set_tracing(true);
+	record();
+	std::thread(record).join();
+	aggregator.set_tracing(false);
+	record();
+
+	std::ostringstream stream;
+	aggregator.write_chrome_trace(stream);
+	const auto trace = stream.str();
+
+	EXPECT_EQ(trace.rfind(R"({"traceEvents":[)", 0), 0u);
+	EXPECT_EQ(count_occurences(trace, R"("ph":"X")"), 4);
+	EXPECT_EQ(count_occurences(trace, R"("name":"traced \"outer\"")"), 2);
+	EXPECT_EQ(count_occurences(trace, R"("name":"traced_inner")"), 2);
+	EXPECT_NE(trace.find(R"("displayTimeUnit":"ns"})"), std::string::npos);
+
+	/* Writing drains the buffers. */
+	std::ostringstream drained;
+	aggregator.write_chrome_trace(drained);
+	EXPECT_EQ(count_occurences(drained.str(), R"("ph":"X")"), 0);
+}
+
+TEST(metric_aggregator, chrome_trace_dropped_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto before = aggregator.trace_events_dropped();
+
+	aggregator.set_tracing(true);
+	std::thread([] {
+		for (std::size_t i = 0; i < mtr::detail::trace_ring::capacity + 5; ++i) {
+			METRICS_RECORD_BLOCK("traced_flood");
+		}
+	}).join();
+	aggregator.set_tracing(false);
+
+	EXPECT_EQ(aggregator.trace_events_dropped() - before, 5u);
+
+	std::ostringstream stream;
+	aggregator.write_chrome_trace(stream);
+	const auto traced = count_occurences(stream.str(), R"("name":"traced_flood")");
+	EXPECT_EQ(static_cast<std::size_t>(traced), mtr::detail::trace_ring::capacity);
+}
+
+TEST(metric_aggregator, perfetto_trace_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto record = []() {
+		METRICS_RECORD_BLOCK("perfetto_outer");
+		METRICS_RECORD_BLOCK("perfetto_inner");
+	};
+
+	std::ostringstream discarded;
+	aggregator.write_chrome_trace(discarded);
+
+	aggregator.set_tracing(true);
+	std::thread([&] {
+		record();
+		record();
+	}).join();
+	aggregator.set_tracing(false);
+
+	std::ostringstream stream;
+	aggregator.write_perfetto_trace(stream);
+
+	std::vector<std::uint64_t> types;
+	std::vector<std::string> names;
+	std::uint64_t elapsed = 0;
+	int tracks = 0;
+	for (const auto &packet : parse_proto(stream.str())) {
+		ASSERT_EQ(packet.number, 1u);
+		for (const auto &field : parse_proto(packet.bytes)) {
+			if (field.number == 8) {
+				elapsed += field.value;
+			} else if (field.number == 60) {
+				++tracks;
+			} else if (field.number == 11) {
+				for (const auto &event_field : parse_proto(field.bytes)) {
+					if (event_field.number == 9) {
+						types.push_back(event_field.value);
+					}
+				}
+			} else if (field.number == 12) {
+				for (const auto &event_name : parse_proto(field.bytes)) {
+					names.push_back(parse_proto(event_name.bytes).at(1).bytes);
+				}
+			}
+		}
+	}
+
+	EXPECT_EQ(tracks, 1);
+	EXPECT_EQ(types, (std::vector<std::uint64_t>{1, 1, 2, 2, 1, 1, 2, 2}));
+	EXPECT_EQ(names, (std::vector<std::string>{"perfetto_outer", "perfetto_inner"}));
+	EXPECT_GT(elapsed, 0u);
+}
+
+TEST(metric_aggregator, flight_recorder_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto path = testing::TempDir() + "flight_recorder_test.bin";
+
+	aggregator.set_flight_recording(true);
+	std::thread([] {
+		for (std::size_t i = 0; i < mtr::detail::flight_ring::capacity + 10; ++i) {
+			METRICS_RECORD_BLOCK("flight_outer");
+			METRICS_RECORD_BLOCK("flight_inner");
+		}
+	}).join();
+
+	/* Takes over the ring of the exited thread, keeping its older records. */
+	std::thread([] { METRICS_RECORD_BLOCK("flight_late"); }).join();
+	aggregator.set_flight_recording(false);
+
+	ASSERT_TRUE(aggregator.write_flight_recording(path.c_str()));
+	std::ifstream file(path, std::ios::binary);
+	const auto recording = mtr::flight_recording::read(file);
+
+	ASSERT_EQ(recording.events.size(), mtr::detail::flight_ring::capacity);
+	std::map<std::string, std::size_t> counts;
+	for (const auto &event : recording.events) {
+		++counts[recording.names.at(event.metric)];
+	}
+	EXPECT_EQ(counts["flight_late"], 1u);
+	/* The late block overwrote the oldest record, an inner one. */
+	EXPECT_EQ(counts["flight_outer"], mtr::detail::flight_ring::capacity / 2);
+	EXPECT_EQ(counts["flight_inner"], mtr::detail::flight_ring::capacity / 2 - 1);
+	EXPECT_NE(recording.events.front().thread, recording.events.back().thread);
+
+	std::istringstream garbage("not a flight recording at all");
+	EXPECT_THROW(mtr::flight_recording::read(garbage), std::runtime_error);
+}
+
+TEST(metric_aggregator, flight_recorder_signal_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto path = testing::TempDir() + "flight_recorder_signal_test.bin";
+	ASSERT_TRUE(aggregator.dump_flight_recording_on_signal(SIGUSR1, path.c_str()));
+
+	aggregator.set_flight_recording(true);
+	{
+		METRICS_RECORD_BLOCK("flight_signalled");
+	}
+	aggregator.set_flight_recording(false);
+
+	std::raise(SIGUSR1);
+	signal(SIGUSR1, SIG_DFL);
+
+	std::ifstream file(path, std::ios::binary);
+	const auto recording = mtr::flight_recording::read(file);
+	const auto signalled = std::count_if(
+	    recording.events.begin(), recording.events.end(),
+	    [&](const auto &event) { return recording.names.at(event.metric) == "flight_signalled"; });
+	EXPECT_EQ(signalled, 1);
+}
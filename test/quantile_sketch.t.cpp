@@ -0,0 +1,121 @@
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "mtr/metrics.hpp"
+
+using namespace ::testing;
+
+namespace {
+
+/* Values spread evenly over the logarithmic range from 1 to 10^12. */
+std::vector<double> wide_range_values() {
+	std::vector<double> values;
+	for (int i = 0; i <= 12000; ++i) {
+		values.push_back(std::pow(10.0, i / 1000.0));
+	}
+	return values;
+}
+
+double exact_quantile(std::vector<double> values, double quantile) {
+	std::sort(values.begin(), values.end());
+	const auto rank = static_cast<std::size_t>(quantile * (values.size() - 1));
+	return values[rank];
+}
+
+} // namespace
+
+TEST(quantile_sketch, relative_accuracy_test) {
+	const auto values = wide_range_values();
+
+	mtr::quantile_sketch sketch(0.01);
+	for (const double value : values) {
+		sketch.record(value);
+	}
+	EXPECT_EQ(sketch.count(), values.size());
+
+	for (const double quantile : {0.0, 0.1, 0.5, 0.9, 0.99, 0.999, 1.0}) {
+		const double exact = exact_quantile(values, quantile);
+		EXPECT_NEAR(sketch.value_at_quantile(quantile), exact, exact * 0.01) << quantile;
+	}
+}
+
+TEST(quantile_sketch, merge_test) {
+	const auto values = wide_range_values();
+
+	mtr::quantile_sketch whole(0.02);
+	mtr::quantile_sketch even(0.02);
+	mtr::quantile_sketch odd(0.02);
+	for (std::size_t i = 0; i < values.size(); ++i) {
+		whole.record(values[i]);
+		(i % 2 == 0 ? even : odd).record(values[i]);
+	}
+	odd.record(0);
+	whole.record(0);
+
+	even.merge(odd);
+	EXPECT_EQ(even.count(), whole.count());
+	for (const double quantile : {0.0, 0.25, 0.5, 0.75, 0.99, 1.0}) {
+		EXPECT_EQ(even.value_at_quantile(quantile), whole.value_at_quantile(quantile));
+	}
+
+	EXPECT_THROW(even.merge(mtr::quantile_sketch(0.01)), std::invalid_argument);
+}
+
+TEST(quantile_sketch, collapse_test) {
+	/* Far more bins than the sketch can hold: the low ones are collapsed
+	 * while the high quantiles stay accurate. */
+	mtr::quantile_sketch sketch(0.001);
+	for (int i = 0; i <= 3000; ++i) {
+		sketch.record(std::pow(10.0, i / 100.0));
+	}
+
+	EXPECT_EQ(sketch.count(), 3001u);
+	EXPECT_NEAR(sketch.value_at_quantile(1.0), 1e30, 1e30 * 0.001);
+	const double p99 = std::pow(10.0, 29.7);
+	EXPECT_NEAR(sketch.value_at_quantile(0.99), p99, p99 * 0.001);
+	EXPECT_GE(sketch.value_at_quantile(0.0), 1.0);
+}
+
+TEST(quantile_sketch, invalid_accuracy_test) {
+	EXPECT_THROW(mtr::quantile_sketch(0.0), std::invalid_argument);
+	EXPECT_THROW(mtr::quantile_sketch(1.0), std::invalid_argument);
+	EXPECT_EQ(mtr::quantile_sketch().value_at_quantile(0.5), 0.0);
+}
+
+TEST(quantile_sketch, aggregator_test) {
+	constexpr int thread_count = 4;
+
+	std::vector<std::thread> threads;
+	for (int t = 0; t < thread_count; ++t) {
+		threads.emplace_back([]() {
+			for (int i = 0; i < 100; ++i) {
+				METRICS_RECORD_BLOCK_SKETCHED("sketched_metric", 0.01);
+			}
+		});
+	}
+
+	for (auto &thread : threads) {
+		thread.join();
+	}
+
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto sketch = aggregator.sketch("sketched_metric");
+	ASSERT_TRUE(sketch);
+	EXPECT_EQ(sketch->count(), thread_count * 100u);
+	EXPECT_FALSE(aggregator.sketch("i_don't_exist"));
+
+	const auto handle = aggregator.register_sketched_metric("sketched_values", 0.01);
+	for (int i = 1; i <= 1000; ++i) {
+		aggregator.update_metric(handle, std::chrono::microseconds(i));
+	}
+	EXPECT_NEAR(aggregator.sketch_quantile<std::chrono::nanoseconds>("sketched_values", 0.5)
+	                .count(),
+	            500000, 5000);
+	EXPECT_EQ(aggregator.sketch_quantile<std::chrono::nanoseconds>("foo", 0.5),
+	          std::chrono::nanoseconds(0));
+}
@@ -0,0 +1,55 @@
+#include <gmock/gmock-matchers.h>
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "mtr/metrics.hpp"
+
+#include <chrono>
+#include <cstdint>
+
+using namespace ::testing;
+
+namespace {
+
+mtr::slow_call call(std::int64_t nanoseconds, std::uint64_t context = 0) {
+    mtr::slow_call call;
+    call.elapsed = std::chrono::nanoseconds(nanoseconds);
+    call.context = context;
+    return call;
+}
+
+} // namespace
+
+TEST(slowest_calls, insert_test) {
+    mtr::slowest_calls slowest;
+    for (std::int64_t i = 1; i <= 100; ++i) {
+        slowest.insert(call((i * 37) % 101, static_cast<std::uint64_t>(i)));
+    }
+
+    const auto sorted = slowest.sorted();
+    ASSERT_THAT(sorted.size(), mtr::slowest_calls::capacity);
+    for (std::size_t i = 0; i < sorted.size(); ++i) {
+        EXPECT_THAT(sorted[i].elapsed, std::chrono::nanoseconds(100 - static_cast<std::int64_t>(i)));
+    }
+
+    /* Only calls slower than the fastest kept one are admitted. */
+    EXPECT_FALSE(slowest.admits(sorted.back().elapsed));
+    EXPECT_TRUE(slowest.admits(sorted.back().elapsed + std::chrono::nanoseconds(1)));
+}
+
+TEST(slowest_calls, merge_test) {
+    mtr::slowest_calls lhs;
+    lhs.insert(call(10, 1));
+    lhs.insert(call(30, 3));
+
+    mtr::slowest_calls rhs;
+    rhs.insert(call(20, 2));
+
+    lhs.merge(rhs);
+
+    const auto sorted = lhs.sorted();
+    ASSERT_THAT(sorted.size(), 3);
+    EXPECT_THAT(sorted[0].context, 3);
+    EXPECT_THAT(sorted[1].context, 2);
+    EXPECT_THAT(sorted[2].context, 1);
+}
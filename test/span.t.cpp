@@ -0,0 +1,115 @@
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <utility>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "mtr/metrics.hpp"
+
+using namespace ::testing;
+
+TEST(span, start_stop_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_metric("span_metric");
+
+	auto span = mtr::start<mtr::virtual_clock>(handle);
+	EXPECT_TRUE(span.is_active());
+	mtr::virtual_clock::advance(std::chrono::nanoseconds(40));
+
+	EXPECT_EQ(mtr::stop(span), std::chrono::nanoseconds(40));
+	EXPECT_FALSE(span.is_active());
+
+	/* A stopped span is not recorded again. */
+	EXPECT_EQ(mtr::stop(span), std::chrono::nanoseconds(0));
+
+	EXPECT_EQ(aggregator.times_entered("span_metric"), 1u);
+	EXPECT_EQ(aggregator.total<std::chrono::nanoseconds>("span_metric"),
+	          std::chrono::nanoseconds(40));
+}
+
+TEST(span, move_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_metric("moved_span_metric");
+
+	/* The span travels from the callback that starts it to the one that
+	 * stops it. */
+	std::function<void()> on_complete;
+	{
+		auto span = mtr::start<mtr::virtual_clock>(handle);
+		on_complete = [span = std::make_shared<mtr::basic_span<mtr::virtual_clock>>(
+		                   std::move(span))]() { mtr::stop(*span); };
+		EXPECT_FALSE(span.is_active());
+		EXPECT_EQ(mtr::stop(span), std::chrono::nanoseconds(0));
+	}
+
+	mtr::virtual_clock::advance(std::chrono::nanoseconds(25));
+	on_complete();
+
+	mtr::basic_span<mtr::virtual_clock> assigned;
+	EXPECT_FALSE(assigned.is_active());
+	assigned = mtr::start<mtr::virtual_clock>(handle);
+	EXPECT_TRUE(assigned.is_active());
+	mtr::virtual_clock::advance(std::chrono::nanoseconds(5));
+	mtr::stop(assigned);
+
+	EXPECT_EQ(aggregator.times_entered("moved_span_metric"), 2u);
+	EXPECT_EQ(aggregator.total<std::chrono::nanoseconds>("moved_span_metric"),
+	          std::chrono::nanoseconds(30));
+}
+
+TEST(span, disabled_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_metric("disabled_span_metric");
+
+	aggregator.set_enabled("disabled_span_metric", false);
+	auto span = mtr::start(handle);
+	aggregator.set_enabled("disabled_span_metric", true);
+
+	EXPECT_FALSE(span.is_active());
+	mtr::stop(span);
+	EXPECT_EQ(aggregator.times_entered("disabled_span_metric"), 0u);
+}
+
+TEST(span, cross_thread_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_metric("cross_thread_span_metric");
+
+	auto span = mtr::start<mtr::virtual_clock>(handle);
+	mtr::virtual_clock::advance(std::chrono::nanoseconds(70));
+
+	/* The span is recorded by the thread that stops it. */
+	std::thread::id stopped_on;
+	std::thread worker([&span, &stopped_on] {
+		stopped_on = std::this_thread::get_id();
+		mtr::stop(span);
+	});
+	worker.join();
+
+	EXPECT_EQ(aggregator.times_entered("cross_thread_span_metric"), 1u);
+	EXPECT_EQ(aggregator.total<std::chrono::nanoseconds>("cross_thread_span_metric"),
+	          std::chrono::nanoseconds(70));
+
+	const auto slowest = aggregator.slowest("cross_thread_span_metric");
+	ASSERT_EQ(slowest.size(), 1u);
+	EXPECT_EQ(slowest[0].thread, stopped_on);
+}
+
+TEST(span, cross_thread_tsc_test) {
+	auto &aggregator = mtr::metric_aggregator::instance();
+	const auto handle = aggregator.register_metric("cross_thread_tsc_span_metric");
+
+	auto span = mtr::start<mtr::tsc_clock>(handle);
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+
+	/* Whichever processor the worker runs on, the span is timed with time
+	 * stamps that can be compared. */
+	std::chrono::nanoseconds elapsed{0};
+	std::thread worker([&span, &elapsed] { elapsed = mtr::stop(span); });
+	worker.join();
+
+	EXPECT_GE(elapsed, std::chrono::milliseconds(2));
+	EXPECT_LT(elapsed, std::chrono::seconds(10));
+	EXPECT_EQ(aggregator.times_entered("cross_thread_tsc_span_metric"), 1u);
+}
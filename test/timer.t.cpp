@@ -0,0 +1,69 @@
+#include <chrono>
+#include <thread>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "mtr/metrics.hpp"
+
+using namespace ::testing;
+
+TEST(tsc_clock, to_nanoseconds_test) {
+	const auto start = mtr::tsc_clock::now();
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	const auto end = mtr::tsc_clock::now();
+
+	EXPECT_GT(end, start);
+	EXPECT_GE(mtr::tsc_clock::to_nanoseconds(end - start), std::chrono::milliseconds(1));
+	EXPECT_LT(mtr::tsc_clock::to_nanoseconds(end - start), std::chrono::seconds(1));
+}
+
+TEST(tsc_timer, elapsed_test) {
+	mtr::tsc_timer timer;
+	std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	EXPECT_GE(timer.elapsed(), std::chrono::milliseconds(1));
+
+	timer.restart();
+	EXPECT_LT(timer.elapsed(), std::chrono::milliseconds(1));
+}
+
+TEST(tsc_timer, macro_test) {
+	for (int i = 0; i < 10; ++i) {
+		METRICS_RECORD_BLOCK_TSC("tsc_metric");
+		std::this_thread::sleep_for(std::chrono::microseconds(100));
+	}
+
+	const auto &aggregator = mtr::metric_aggregator::instance();
+	EXPECT_EQ(aggregator.times_entered("tsc_metric"), 10u);
+	EXPECT_GE(aggregator.min<std::chrono::microseconds>("tsc_metric"),
+	          std::chrono::microseconds(50));
+}
+
+TEST(virtual_clock, macro_test) {
+	mtr::virtual_clock::set(std::chrono::seconds(1));
+	for (int i = 1; i <= 3; ++i) {
+		METRICS_RECORD_BLOCK_WITH(mtr::virtual_clock, "virtual_metric");
+		mtr::virtual_clock::advance(std::chrono::milliseconds(i));
+	}
+
+	const auto &aggregator = mtr::metric_aggregator::instance();
+	EXPECT_EQ(aggregator.times_entered("virtual_metric"), 3u);
+	EXPECT_EQ(aggregator.total<std::chrono::milliseconds>("virtual_metric"),
+	          std::chrono::milliseconds(6));
+	EXPECT_EQ(aggregator.min<std::chrono::milliseconds>("virtual_metric"),
+	          std::chrono::milliseconds(1));
+	EXPECT_EQ(aggregator.max<std::chrono::milliseconds>("virtual_metric"),
+	          std::chrono::milliseconds(3));
+}
+
+TEST(coarse_clock, elapsed_test) {
+	mtr::basic_timer<mtr::coarse_clock> timer;
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	EXPECT_GE(timer.elapsed(), std::chrono::milliseconds(10));
+}
+
+TEST(thread_cpu_clock, elapsed_test) {
+	mtr::basic_timer<mtr::thread_cpu_clock> timer;
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	/* A sleeping thread does not consume CPU time. */
+	EXPECT_LT(timer.elapsed(), std::chrono::milliseconds(10));
+}
@@ -0,0 +1,78 @@
+#include <gmock/gmock-matchers.h>
+#include "gtest/gtest.h"
+#include "gmock/gmock.h"
+
+#include "mtr/metrics.hpp"
+
+#include <chrono>
+#include <cstdint>
+
+using namespace ::testing;
+
+namespace {
+
+constexpr std::uint64_t seconds(std::uint64_t count) {
+    return count * 1'000'000'000;
+}
+
+} // namespace
+
+TEST(window_recording, summary_test) {
+    mtr::window_recording window;
+    window.update(std::chrono::nanoseconds(10), seconds(100));
+    window.update(std::chrono::nanoseconds(20), seconds(100) + 500);
+    window.update(std::chrono::nanoseconds(30), seconds(105));
+
+    const auto last = window.summary(std::chrono::seconds(1), seconds(105));
+    EXPECT_THAT(last.times_entered(), 1);
+    EXPECT_THAT(last.total(), std::chrono::nanoseconds(30));
+
+    const auto all = window.summary(std::chrono::seconds(10), seconds(105));
+    EXPECT_THAT(all.times_entered(), 3);
+    EXPECT_THAT(all.total(), std::chrono::nanoseconds(60));
+    EXPECT_THAT(all.min(), std::chrono::nanoseconds(10));
+    EXPECT_THAT(all.max(), std::chrono::nanoseconds(30));
+
+    /* Nothing was recorded in the last second at t=110s. */
+    const auto idle = window.summary(std::chrono::seconds(1), seconds(110));
+    EXPECT_THAT(idle.times_entered(), 0);
+    EXPECT_THAT(idle.min(), std::chrono::nanoseconds(0));
+    EXPECT_THAT(idle.max(), std::chrono::nanoseconds(0));
+}
+
+TEST(window_recording, rotation_test) {
+    mtr::window_recording window;
+    window.update(std::chrono::nanoseconds(10), seconds(0));
+
+    /* Lands in the same slot a full window later and evicts the old interval. */
+    window.update(std::chrono::nanoseconds(20), seconds(60));
+
+    const auto all = window.summary(std::chrono::minutes(10), seconds(60));
+    EXPECT_THAT(all.times_entered(), 1);
+    EXPECT_THAT(all.total(), std::chrono::nanoseconds(20));
+
+    /* Intervals older than the window are never reported. */
+    EXPECT_THAT(window.summary(std::chrono::minutes(1), seconds(200)).times_entered(), 0);
+}
+
+TEST(window_recording, merge_test) {
+    mtr::window_recording lhs;
+    lhs.update(std::chrono::nanoseconds(10), seconds(1));
+    lhs.update(std::chrono::nanoseconds(20), seconds(2));
+
+    mtr::window_recording rhs;
+    rhs.update(std::chrono::nanoseconds(30), seconds(2));
+    rhs.update(std::chrono::nanoseconds(40), seconds(62));
+
+    lhs.merge(rhs);
+
+    /* The slot of t=2s now holds the newer interval of t=62s. */
+    const auto all = lhs.summary(std::chrono::minutes(1), seconds(62));
+    EXPECT_THAT(all.times_entered(), 1);
+    EXPECT_THAT(all.total(), std::chrono::nanoseconds(40));
+
+    /* Only the interval of t=1s survives from before. */
+    const auto old = lhs.summary(std::chrono::seconds(2), seconds(2));
+    EXPECT_THAT(old.times_entered(), 1);
+    EXPECT_THAT(old.total(), std::chrono::nanoseconds(10));
+}